@@ -21,47 +21,84 @@ typedef enum {
 	PKT_OK = 0,
 	PKT_RX_SERIAL_EMPTY,
 	PKT_RX_SERIAL_ERROR,
-	PKT_RX_CRC_ERROR
+	PKT_RX_CRC_ERROR,
+	PKT_RX_RESYNC,
 } pkt_res_t;
 
 nand_cfg_rx NAND;
+uint32_t pkt_resyncs;
 
 pkt_res_t data_receive(pkt_hdr_t *pkt_hdr, void* data, uint32_t data_len)
 {
 	uint32_t rx_crc = 0;
-	int ser_len = serial_read(data, data_len);
-	int crc_len = serial_read(&rx_crc, DATA_CRC_LEN);
+	uint32_t calc_crc;
 
-	if (ser_len == data_len && crc_len == DATA_CRC_LEN) {
-		uint32_t calc_crc = crc32(CRC32_START, data, data_len);
-		if (rx_crc != calc_crc)
-			return PKT_RX_CRC_ERROR;
-	}
+	/* Unexpected data is left to be dropped by the next resync */
+	if (le32toh(pkt_hdr->data_len) != data_len)
+		return PKT_RX_SERIAL_ERROR;
+
+	if (serial_read(data, data_len) != data_len ||
+	    serial_read(&rx_crc, DATA_CRC_LEN) != DATA_CRC_LEN)
+		return PKT_RX_SERIAL_ERROR;
+
+	calc_crc = crc32(CRC32_START, data, data_len);
+	if (le32toh(rx_crc) != calc_crc)
+		return PKT_RX_CRC_ERROR;
 
 	return PKT_OK;
 }
 
+uint32_t _pkt_sync_offset(const uint8_t *buf, uint32_t len)
+{
+	const uint32_t magic = htole32(PKT_MAGIC);
+	uint32_t offset;
+
+	/* Next offset matching the magic, partially at the end */
+	for (offset = 1; offset < len; offset++)
+		if (!memcmp(buf + offset, &magic, MIN(len - offset, sizeof(magic))))
+			break;
+
+	return offset;
+}
+
 pkt_res_t pkt_receive(pkt_hdr_t *pkt_hdr, void* data, uint32_t data_len)
 {
+	uint8_t *hdr = (uint8_t *) pkt_hdr;
 	uint32_t hdr_len = sizeof(pkt_hdr_t);
-	int ser_len = serial_read(pkt_hdr, hdr_len);
-	int res;
-
-	if (ser_len == hdr_len && le32toh(pkt_hdr->magic) == PKT_MAGIC) {
-		uint16_t hdr_crc = crc16(CRC16_START, pkt_hdr, PKT_HDR_CRC_LEN);
-
-		if (hdr_crc == le16toh(pkt_hdr->hdr_crc))
-			res = PKT_OK;
-		else
-			res = PKT_RX_CRC_ERROR;
-	} else if (ser_len == 0) {
-		res = PKT_RX_SERIAL_EMPTY;
-	} else {
-		res = PKT_RX_SERIAL_ERROR;
+	uint32_t len = 0;
+	uint32_t offset;
+	pkt_res_t res = PKT_OK;
+
+	while (1) {
+		len += serial_read(hdr + len, hdr_len - len);
+		if (len < hdr_len) {
+			if (len == 0 && res == PKT_OK)
+				return PKT_RX_SERIAL_EMPTY;
+			return PKT_RX_SERIAL_ERROR;
+		}
+
+		if (le32toh(pkt_hdr->magic) == PKT_MAGIC &&
+		    crc16(CRC16_START, pkt_hdr, PKT_HDR_CRC_LEN) ==
+		    le16toh(pkt_hdr->hdr_crc))
+			break;
+
+		/* Drop corrupt bytes up to the next possible header */
+		offset = _pkt_sync_offset(hdr, len);
+		memmove(hdr, hdr + offset, len - offset);
+		len -= offset;
+
+		if (res == PKT_OK) {
+			pkt_resyncs++;
+			res = PKT_RX_RESYNC;
+		}
 	}
 
-	if (data && res == PKT_OK)
-		res = data_receive(pkt_hdr, data, data_len);
+	if (data) {
+		pkt_res_t data_res = data_receive(pkt_hdr, data, data_len);
+
+		if (data_res != PKT_OK)
+			res = data_res;
+	}
 
 	return res;
 }
@@ -124,6 +161,28 @@ void cmd_error(cmd_res_t cmd_res)
 	pkt_send(CMD_ERROR, &data, sizeof(data));
 }
 
+void _nand_config(const nand_cfg_rx *nc)
+{
+	NAND.raw_page_size = le32toh(nc->raw_page_size);
+	NAND.read_delay_us = le32toh(nc->read_delay_us);
+	NAND.pull_up = nc->pull_up;
+	NAND.re_delay_nops = nc->re_delay_nops;
+}
+
+int cmd_nand_id_config(pkt_hdr_t *rx_hdr)
+{
+	nand_cfg_rx nc;
+
+	memset(&nc, 0, sizeof(nc));
+	if (data_receive(rx_hdr, &nc, sizeof(nc)) != PKT_OK)
+		return CMD_ERROR_CRC;
+
+	/* No response, the host may change settings between page reads */
+	_nand_config(&nc);
+
+	return CMD_OK;
+}
+
 int cmd_nand_id_read(pkt_hdr_t *rx_hdr)
 {
 	nand_id_tx data;
@@ -140,11 +199,9 @@ int cmd_nand_id_read(pkt_hdr_t *rx_hdr)
 		NOP();
 
 	pkt_res = pkt_receive(&tx_hdr, &nc, sizeof(nc));
-	if (pkt_res == PKT_OK && tx_hdr.cmd == CMD_NAND_ID_CONFIG) {
-		NAND.raw_page_size = le32toh(nc.raw_page_size);
-		NAND.read_delay_us = le32toh(nc.read_delay_us);
-		NAND.pull_up = nc.pull_up;
-	}
+	if ((pkt_res == PKT_OK || pkt_res == PKT_RX_RESYNC) &&
+	    le16toh(tx_hdr.cmd) == CMD_NAND_ID_CONFIG)
+		_nand_config(&nc);
 
 	return CMD_OK;
 }
@@ -157,7 +214,8 @@ int cmd_nand_page_read(pkt_hdr_t *rx_hdr)
 	uint32_t crc = CRC32_START;
 
 	memset(&page, 0, sizeof(page));
-	data_receive(rx_hdr, &page, sizeof(page));
+	if (data_receive(rx_hdr, &page, sizeof(page)) != PKT_OK)
+		return CMD_ERROR_CRC;
 
 	pkt_send(CMD_NAND_PAGE_READ, NULL, NAND.raw_page_size);
 
@@ -175,6 +233,117 @@ int cmd_nand_page_read(pkt_hdr_t *rx_hdr)
 	return CMD_OK;
 }
 
+int cmd_nand_page_read_vote(pkt_hdr_t *rx_hdr)
+{
+	nand_page_vote_rx vote;
+	nand_vote_tx data;
+	uint8_t buffer[VOTE_CHUNK_SIZE];
+	uint32_t len = 0;
+	uint32_t crc = CRC32_START;
+	uint32_t unstable = 0;
+
+	memset(&vote, 0, sizeof(vote));
+	if (data_receive(rx_hdr, &vote, sizeof(vote)) != PKT_OK)
+		return CMD_ERROR_CRC;
+
+	if (!vote.reads || vote.reads > NAND_VOTE_MAX_READS)
+		return CMD_ERROR_NOT_SUPPORTED;
+	/* Chunked voting needs a column address */
+	if (NAND.raw_page_size > VOTE_CHUNK_SIZE &&
+	    vote.addr.addr_len != NAND_ADDR_SIZE)
+		return CMD_ERROR_NOT_SUPPORTED;
+
+	pkt_send(CMD_NAND_PAGE_READ_VOTE, NULL,
+		 NAND.raw_page_size + sizeof(data));
+
+	while (len < NAND.raw_page_size) {
+		uint32_t cur_len = MIN(VOTE_CHUNK_SIZE, NAND.raw_page_size - len);
+
+		unstable += nand_read_page_vote(&vote.addr, len, buffer, cur_len,
+						vote.reads);
+		crc = crc32(crc, buffer, cur_len);
+		serial_write(buffer, cur_len);
+
+		len += cur_len;
+	}
+
+	data.unstable_bits = htole32(unstable);
+	crc = crc32(crc, &data, sizeof(data));
+	serial_write(&data, sizeof(data));
+	serial_write(&crc, DATA_CRC_LEN);
+
+	return CMD_OK;
+}
+
+int cmd_nand_block_erase(pkt_hdr_t *rx_hdr)
+{
+	nand_block_erase_rx block;
+	nand_status_tx data;
+
+	memset(&block, 0, sizeof(block));
+	if (data_receive(rx_hdr, &block, sizeof(block)) != PKT_OK)
+		return CMD_ERROR_CRC;
+
+	memset(&data, 0, sizeof(data));
+	if (nand_erase_finish())
+		data.flags |= NAND_STATUS_ERASE_FAIL;
+	data.status = nand_erase_block(&block.addr,
+				       !(block.flags & NAND_ERASE_NOWAIT));
+
+	pkt_send(CMD_NAND_BLOCK_ERASE, &data, sizeof(data));
+
+	return CMD_OK;
+}
+
+int cmd_nand_page_write(pkt_hdr_t *rx_hdr)
+{
+	nand_page_write_rx page;
+	nand_status_tx data;
+	uint8_t buffer[IO_BUFFER_SIZE];
+	uint32_t len = 0;
+	uint32_t crc = CRC32_START;
+	uint32_t rx_crc = 0;
+
+	if (le32toh(rx_hdr->data_len) != sizeof(page) + NAND.raw_page_size)
+		return CMD_ERROR_TRANSFER;
+
+	memset(&page, 0, sizeof(page));
+	if (serial_read(&page, sizeof(page)) != sizeof(page))
+		return CMD_ERROR_TRANSFER;
+	crc = crc32(crc, &page, sizeof(page));
+
+	memset(&data, 0, sizeof(data));
+	while (len < NAND.raw_page_size) {
+		uint32_t cur_len = MIN(IO_BUFFER_SIZE, NAND.raw_page_size - len);
+
+		if (serial_read(buffer, cur_len) != cur_len) {
+			nand_page_abort();
+			return CMD_ERROR_TRANSFER;
+		}
+		crc = crc32(crc, buffer, cur_len);
+
+		/* The page was buffered while a pending erase finished */
+		if (len == 0 && nand_erase_finish())
+			data.flags |= NAND_STATUS_ERASE_FAIL;
+		nand_write_page(&page.addr, buffer, cur_len, len == 0);
+
+		len += cur_len;
+	}
+
+	/* Only confirm the program once the whole page passed its CRC */
+	if (serial_read(&rx_crc, DATA_CRC_LEN) != DATA_CRC_LEN ||
+	    le32toh(rx_crc) != crc) {
+		nand_page_abort();
+		return CMD_ERROR_CRC;
+	}
+
+	data.status = nand_page_program(page.flags & NAND_PAGE_CACHE);
+
+	pkt_send(CMD_NAND_PAGE_WRITE, &data, sizeof(data));
+
+	return CMD_OK;
+}
+
 int cmd_ping(pkt_hdr_t *pkt_hdr)
 {
 	ping_tx data = {
@@ -182,6 +351,7 @@ int cmd_ping(pkt_hdr_t *pkt_hdr)
 		.version = htole16(PROTOCOL_VERSION),
 		.serial_speed = htole32(serial_get_baud()),
 		.memory_free = htole32(device_freeram()),
+		.resyncs = htole32(pkt_resyncs),
 	};
 
 	pkt_send(CMD_PING, &data, sizeof(data));
@@ -189,6 +359,20 @@ int cmd_ping(pkt_hdr_t *pkt_hdr)
 	return CMD_OK;
 }
 
+int cmd_nand_status(pkt_hdr_t *pkt_hdr)
+{
+	nand_status_tx data;
+
+	memset(&data, 0, sizeof(data));
+	if (nand_erase_finish())
+		data.flags |= NAND_STATUS_ERASE_FAIL;
+	data.status = nand_status();
+
+	pkt_send(CMD_NAND_STATUS, &data, sizeof(data));
+
+	return CMD_OK;
+}
+
 int cmd_restart(pkt_hdr_t *pkt_hdr)
 {
 	reboot_tx data = {
@@ -217,6 +401,9 @@ void cmd_process(pkt_hdr_t *pkt_hdr)
 		case CMD_BOOTLOADER:
 			res = cmd_bootloader(pkt_hdr);
 			break;
+		case CMD_NAND_ID_CONFIG:
+			res = cmd_nand_id_config(pkt_hdr);
+			break;
 		case CMD_NAND_ID_READ:
 			res = cmd_nand_id_read(pkt_hdr);
 			device_release_ports();
@@ -225,6 +412,27 @@ void cmd_process(pkt_hdr_t *pkt_hdr)
 			res = cmd_nand_page_read(pkt_hdr);
 			device_release_ports();
 			break;
+		case CMD_NAND_PAGE_READ_VOTE:
+			res = cmd_nand_page_read_vote(pkt_hdr);
+			device_release_ports();
+			break;
+		case CMD_NAND_BLOCK_ERASE:
+			res = cmd_nand_block_erase(pkt_hdr);
+			/* Keep driving the bus while the erase is running */
+			if (!nand_pending())
+				device_release_ports();
+			break;
+		case CMD_NAND_PAGE_WRITE:
+			res = cmd_nand_page_write(pkt_hdr);
+			/* Keep driving the bus while a cache program is open */
+			if (!nand_pending())
+				device_release_ports();
+			break;
+		case CMD_NAND_STATUS:
+			res = cmd_nand_status(pkt_hdr);
+			if (!nand_pending())
+				device_release_ports();
+			break;
 		case CMD_PING:
 			res = cmd_ping(pkt_hdr);
 			break;
@@ -252,6 +460,12 @@ int main(void)
 				pkt_hdr_t pkt_hdr;
 				pkt_res_t pkt_res = pkt_receive(&pkt_hdr, NULL, 0);
 
+				/* Answers the corrupt packet, keeping responses in step */
+				if (pkt_res == PKT_RX_RESYNC) {
+					cmd_error(CMD_ERROR_TRANSFER);
+					pkt_res = PKT_OK;
+				}
+
 				if (pkt_res == PKT_OK)
 					cmd_process(&pkt_hdr);
 				else
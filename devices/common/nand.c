@@ -1,5 +1,7 @@
 // SPDX-License-Identifier: MIT
 
+#include <string.h>
+
 #include "common.h"
 #include "device.h"
 #include "nand.h"
@@ -7,25 +9,126 @@
 
 extern nand_cfg_rx NAND;
 
+int cache_pending = 0;
+int erase_failed = 0;
+int erase_pending = 0;
+
+uint8_t _nand_status(void)
+{
+	uint8_t status;
+
+	nand_cmd(NC_STATUS);
+	nand_io_in();
+	status = nand_io_read();
+	nand_io_out();
+
+	return status;
+}
+
+int _nand_wait_ready(void)
+{
+	uint32_t us = RB_TOUT_MS * 1000UL;
+
+	while (us--) {
+		if (_nand_status() & NS_ARDY)
+			return 1;
+		device_usleep(1);
+	}
+
+	return 0;
+}
+
+/* Wait for a non-blocking erase, a failure stays latched until reported */
+void _nand_erase_wait(void)
+{
+	if (!erase_pending)
+		return;
+
+	nand_wait_rb();
+	erase_pending = 0;
+
+	if (_nand_status() & NS_FAIL)
+		erase_failed = 1;
+}
+
 void _nand_reset(void)
 {
+	/* Don't abort a running erase */
+	_nand_erase_wait();
+
 	nand_enable();
 
 	nand_cmd(NC_RESET);
 
 	nand_wait_rb();
+
+	cache_pending = 0;
+	erase_pending = 0;
 }
 
-uint8_t _nand_status(void)
+uint8_t nand_erase_block(const nand_addr_rx *block, int wait)
 {
-	uint8_t status;
+	uint32_t offset;
 
-	nand_cmd(NC_STATUS);
-	nand_io_in();
-	status = nand_io_read();
-	nand_io_out();
+	nand_enable();
 
-	return status;
+	nand_cmd(NC_ERASE1);
+
+	nand_ale_high();
+	for (offset = 0; offset < block->addr_len; offset++)
+		nand_io_set(block->addr[offset]);
+	nand_ale_low();
+
+	nand_cmd(NC_ERASE2);
+
+	if (wait)
+		nand_wait_rb();
+	else
+		erase_pending = 1;
+
+	return _nand_status();
+}
+
+/*
+ * Wait for a non-blocking erase, returns 1 if it failed, even when the
+ * failure was latched while waiting for it before another command.
+ */
+int nand_erase_finish(void)
+{
+	int failed;
+
+	_nand_erase_wait();
+	failed = erase_failed;
+	erase_failed = 0;
+
+	return failed;
+}
+
+void nand_page_abort(void)
+{
+	/* A previous cache page may still be programming */
+	_nand_wait_ready();
+	_nand_reset();
+}
+
+uint8_t nand_page_program(int cache)
+{
+	if (cache) {
+		nand_cmd(NC_CACHE_P2);
+		cache_pending = 1;
+	} else {
+		nand_cmd(NC_PAGE_P2);
+		cache_pending = 0;
+	}
+
+	nand_wait_rb();
+
+	return _nand_status();
+}
+
+int nand_pending(void)
+{
+	return cache_pending || erase_pending;
 }
 
 int nand_read_id(nand_id_tx *nand_id)
@@ -55,6 +158,7 @@ int nand_read_page(const nand_addr_rx *page, uint8_t *buffer, uint32_t len, int
 	uint32_t offset;
 
 	if (set) {
+		_nand_erase_wait();
 		nand_enable();
 
 		nand_cmd(NC_READ1);
@@ -75,8 +179,95 @@ int nand_read_page(const nand_addr_rx *page, uint8_t *buffer, uint32_t len, int
 	if (set)
 		nand_wait_rb();
 
+	nand_io_read_buf(buffer, len);
+
+	return 0;
+}
+
+/*
+ * Sense the page "reads" times and return the bitwise majority in buffer.
+ * Votes are accumulated in bit-sliced counters so only len bytes per counter
+ * bit are needed regardless of the number of reads. Ties resolve to 1, the
+ * erased state. Returns the number of bits that did not read the same every
+ * time.
+ */
+uint32_t nand_read_page_vote(const nand_addr_rx *page, uint32_t column,
+			     uint8_t *buffer, uint32_t len, uint8_t reads)
+{
+	uint8_t count[VOTE_COUNT_BITS][VOTE_CHUNK_SIZE];
+	nand_addr_rx addr = *page;
+	uint32_t unstable = 0;
+	uint32_t offset;
+	uint8_t bit, plane, read;
+
+	/* Large page devices take a two byte column address */
+	if (addr.addr_len == NAND_ADDR_SIZE) {
+		addr.addr[0] = column & 0xFF;
+		addr.addr[1] = (column >> 8) & 0xFF;
+	}
+
+	memset(count, 0, sizeof(count));
+	for (read = 0; read < reads; read++) {
+		nand_read_page(&addr, buffer, len, 1);
+
+		for (offset = 0; offset < len; offset++) {
+			uint8_t carry = buffer[offset];
+
+			for (plane = 0; plane < VOTE_COUNT_BITS; plane++) {
+				uint8_t next = count[plane][offset] & carry;
+
+				count[plane][offset] ^= carry;
+				carry = next;
+			}
+		}
+	}
+
+	for (offset = 0; offset < len; offset++) {
+		uint8_t data = 0;
+
+		for (bit = 0; bit < 8; bit++) {
+			uint8_t ones = 0;
+
+			for (plane = 0; plane < VOTE_COUNT_BITS; plane++)
+				if (count[plane][offset] & BIT(bit))
+					ones |= BIT(plane);
+
+			if (ones * 2 >= reads)
+				data |= BIT(bit);
+			if (ones && ones != reads)
+				unstable++;
+		}
+
+		buffer[offset] = data;
+	}
+
+	return unstable;
+}
+
+uint8_t nand_status(void)
+{
+	nand_enable();
+
+	return _nand_status();
+}
+
+int nand_write_page(const nand_addr_rx *page, const uint8_t *buffer, uint32_t len, int set)
+{
+	uint32_t offset;
+
+	if (set) {
+		nand_enable();
+
+		nand_cmd(NC_PAGE_P1);
+
+		nand_ale_high();
+		for (offset = 0; offset < page->addr_len; offset++)
+			nand_io_set(page->addr[offset]);
+		nand_ale_low();
+	}
+
 	for (offset = 0; offset < len; offset++)
-		buffer[offset] = nand_io_read();
+		nand_io_set(buffer[offset]);
 
 	return 0;
 }
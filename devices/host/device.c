@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "device.h"
+#include "private.h"
+#include "protocol.h"
+
+void device_bootloader(void)
+{
+	fprintf(stderr, "host: bootloader requested, exiting\n");
+	exit(0);
+}
+
+uint32_t device_freeram(void)
+{
+	return 0;
+}
+
+uint8_t device_id(void)
+{
+	return DEV_HOST;
+}
+
+void device_init(void)
+{
+	nand_host_init();
+
+	serial_begin();
+}
+
+void device_msleep(uint32_t ms)
+{
+	usleep(ms * 1000);
+}
+
+void device_release_ports(void)
+{
+}
+
+void device_restart(void)
+{
+	fprintf(stderr, "host: restart requested, exiting\n");
+	exit(0);
+}
+
+void device_usleep(uint32_t us)
+{
+	usleep(us);
+}
@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: MIT
+
+#include <stdint.h>
+#include <time.h>
+
+#include "common.h"
+#include "private.h"
+
+uint32_t micros(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+uint32_t millis(void)
+{
+	return micros() / 1000;
+}
@@ -0,0 +1,405 @@
+// SPDX-License-Identifier: MIT
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "device.h"
+#include "nand.h"
+#include "private.h"
+
+#define SIM_ADDR_MAX	8
+
+typedef enum {
+	SIM_IDLE = 0,
+	SIM_ID,
+	SIM_READ,
+	SIM_PROG,
+	SIM_ERASE,
+	SIM_STATUS,
+} sim_mode_t;
+
+struct sim_device {
+	uint8_t mf_id;
+	uint8_t dev_id;
+	/* Zero if encoded in the 4th and 5th ID bytes */
+	uint32_t page_size;
+	uint32_t oob_size;
+	uint32_t block_size;
+	uint64_t size;
+};
+
+/* Devices of nand_io/const.py */
+static const struct sim_device sim_devices[] = {
+	{ 0xAD, 0x73, 512, 16, 16384, 16ULL << 20 },
+	{ 0xC8, 0xDA, 0, 0, 0, 0 },
+	{ 0xEC, 0x79, 512, 16, 16384, 128ULL << 20 },
+};
+
+struct nand_sim {
+	/* Geometry */
+	uint8_t id[5];
+	uint32_t raw_page_size;
+	uint32_t pages;
+	uint32_t block_pages;
+	uint32_t col_cycles;
+	/* Timings */
+	uint32_t t_r_us;
+	uint32_t t_prog_us;
+	uint32_t t_bers_us;
+	/* State */
+	sim_mode_t mode;
+	uint8_t addr[SIM_ADDR_MAX];
+	uint32_t addr_len;
+	uint32_t column;
+	uint32_t row;
+	uint32_t busy_until;
+	uint8_t status_fail;
+	int ale;
+	int sensed;
+	uint8_t *array;
+	uint8_t *reg;
+};
+
+struct nand_sim SIM;
+
+uint32_t _sim_env(const char *name, uint32_t def)
+{
+	const char *value = getenv(name);
+
+	if (!value || !*value)
+		return def;
+
+	return strtoul(value, NULL, 0);
+}
+
+int _sim_ready(void)
+{
+	return (int32_t) (micros() - SIM.busy_until) >= 0;
+}
+
+void _sim_busy(uint32_t us)
+{
+	SIM.busy_until = micros() + us;
+}
+
+void _sim_decode_addr(void)
+{
+	uint32_t i;
+
+	SIM.column = 0;
+	for (i = 0; i < SIM.col_cycles && i < SIM.addr_len; i++)
+		SIM.column |= SIM.addr[i] << (8 * i);
+
+	SIM.row = 0;
+	for (; i < SIM.addr_len; i++)
+		SIM.row |= SIM.addr[i] << (8 * (i - SIM.col_cycles));
+}
+
+uint8_t *_sim_page(uint32_t row)
+{
+	if (row >= SIM.pages) {
+		fprintf(stderr, "host: page %u out of range\n", row);
+		return NULL;
+	}
+
+	return SIM.array + (uint64_t) row * SIM.raw_page_size;
+}
+
+void _sim_sense(void)
+{
+	uint8_t *page;
+
+	_sim_decode_addr();
+	page = _sim_page(SIM.row);
+	if (page)
+		memcpy(SIM.reg, page, SIM.raw_page_size);
+	else
+		memset(SIM.reg, 0xFF, SIM.raw_page_size);
+	SIM.sensed = 1;
+	_sim_busy(SIM.t_r_us);
+}
+
+void _sim_program(void)
+{
+	uint8_t *page;
+	uint32_t i;
+
+	_sim_decode_addr();
+	page = _sim_page(SIM.row);
+	if (!page) {
+		SIM.status_fail = NS_FAIL;
+		return;
+	}
+	/* Programming can only clear bits */
+	for (i = 0; i < SIM.raw_page_size; i++)
+		page[i] &= SIM.reg[i];
+
+	SIM.status_fail = 0;
+	_sim_busy(SIM.t_prog_us);
+}
+
+void _sim_erase(void)
+{
+	uint8_t *page;
+	uint32_t row = 0;
+	uint32_t i;
+
+	for (i = 0; i < SIM.addr_len; i++)
+		row |= SIM.addr[i] << (8 * i);
+	row -= row % SIM.block_pages;
+
+	page = _sim_page(row);
+	if (!page) {
+		SIM.status_fail = NS_FAIL;
+		return;
+	}
+	memset(page, 0xFF, SIM.block_pages * SIM.raw_page_size);
+
+	SIM.status_fail = 0;
+	_sim_busy(SIM.t_bers_us);
+}
+
+/*
+ * Geometry of the simulated chip, decoded from its ID like the host does so
+ * both always agree.
+ */
+void _sim_geometry(void)
+{
+	const struct sim_device *dev = NULL;
+	uint32_t page_size;
+	uint32_t oob_size;
+	uint32_t block_size;
+	uint64_t size;
+	size_t i;
+
+	for (i = 0; i < sizeof(sim_devices) / sizeof(sim_devices[0]); i++)
+		if (sim_devices[i].mf_id == SIM.id[0] &&
+		    sim_devices[i].dev_id == SIM.id[1])
+			dev = &sim_devices[i];
+	if (!dev) {
+		fprintf(stderr, "host: unknown NAND ID %02X%02X\n",
+			SIM.id[0], SIM.id[1]);
+		exit(1);
+	}
+
+	if (dev->page_size) {
+		page_size = dev->page_size;
+		oob_size = dev->oob_size;
+		block_size = dev->block_size;
+		size = dev->size;
+	} else {
+		page_size = 1024 << (SIM.id[3] & 0x03);
+		oob_size = (8 << ((SIM.id[3] >> 2) & 0x01)) * (page_size / 512);
+		block_size = (64 * 1024) << ((SIM.id[3] >> 4) & 0x03);
+		size = ((uint64_t) 8 << 20) << ((SIM.id[4] >> 4) & 0x07);
+		size <<= (SIM.id[4] >> 2) & 0x03;
+	}
+
+	SIM.raw_page_size = page_size + oob_size;
+	SIM.block_pages = block_size / page_size;
+	SIM.pages = size / page_size;
+	SIM.col_cycles = page_size > 512 ? 2 : 1;
+}
+
+void nand_host_init(void)
+{
+	const char *image = getenv("NAND_IO_IMAGE");
+	const char *id = getenv("NAND_HOST_ID");
+	struct stat st;
+	uint64_t size;
+	int fd = -1;
+	int i;
+
+	memset(&SIM, 0, sizeof(SIM));
+
+	/* Default to a Hynix HY27US08281A */
+	SIM.id[0] = 0xAD;
+	SIM.id[1] = 0x73;
+	if (id)
+		for (i = 0; i < 5 && id[2 * i] && id[2 * i + 1]; i++)
+			sscanf(id + 2 * i, "%2hhx", &SIM.id[i]);
+
+	_sim_geometry();
+	SIM.t_r_us = _sim_env("NAND_HOST_TR_US", 0);
+	SIM.t_prog_us = _sim_env("NAND_HOST_TPROG_US", 0);
+	SIM.t_bers_us = _sim_env("NAND_HOST_TBERS_US", 0);
+
+	size = (uint64_t) SIM.pages * SIM.raw_page_size;
+	if (image) {
+		fd = open(image, O_RDWR | O_CREAT, 0644);
+		if (fd < 0 || fstat(fd, &st) || ftruncate(fd, size)) {
+			perror("host: image");
+			exit(1);
+		}
+		SIM.array = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		/* New areas start out erased */
+		if (SIM.array != MAP_FAILED && (uint64_t) st.st_size < size)
+			memset(SIM.array + st.st_size, 0xFF, size - st.st_size);
+	} else {
+		SIM.array = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (SIM.array != MAP_FAILED)
+			memset(SIM.array, 0xFF, size);
+	}
+	if (SIM.array == MAP_FAILED) {
+		perror("host: mmap");
+		exit(1);
+	}
+
+	SIM.reg = malloc(SIM.raw_page_size);
+}
+
+void nand_ale_high(void)
+{
+	SIM.ale = 1;
+}
+
+void nand_ale_low(void)
+{
+	SIM.ale = 0;
+
+	if (SIM.mode == SIM_READ && !SIM.sensed)
+		_sim_decode_addr();
+}
+
+void nand_cmd(uint8_t cmd)
+{
+	switch (cmd) {
+		case NC_RESET:
+			SIM.mode = SIM_IDLE;
+			SIM.busy_until = micros();
+			break;
+		case NC_READ_ID:
+			SIM.mode = SIM_ID;
+			SIM.column = 0;
+			SIM.addr_len = 0;
+			break;
+		case NC_READ1:
+			SIM.mode = SIM_READ;
+			SIM.addr_len = 0;
+			SIM.sensed = 0;
+			break;
+		case NC_READ2:
+			_sim_sense();
+			break;
+		case NC_PAGE_P1:
+			SIM.mode = SIM_PROG;
+			SIM.addr_len = 0;
+			SIM.column = 0;
+			memset(SIM.reg, 0xFF, SIM.raw_page_size);
+			break;
+		case NC_PAGE_P2:
+		case NC_CACHE_P2:
+			if (SIM.mode == SIM_PROG)
+				_sim_program();
+			SIM.mode = SIM_IDLE;
+			break;
+		case NC_ERASE1:
+			SIM.mode = SIM_ERASE;
+			SIM.addr_len = 0;
+			break;
+		case NC_ERASE2:
+			if (SIM.mode == SIM_ERASE)
+				_sim_erase();
+			SIM.mode = SIM_IDLE;
+			break;
+		case NC_STATUS:
+			SIM.mode = SIM_STATUS;
+			break;
+		default:
+			fprintf(stderr, "host: unknown NAND command %02X\n", cmd);
+			break;
+	}
+}
+
+void nand_disable(void)
+{
+}
+
+void nand_enable(void)
+{
+}
+
+void nand_io_in(void)
+{
+}
+
+void nand_io_out(void)
+{
+}
+
+uint8_t nand_io_read(void)
+{
+	uint8_t data = 0xFF;
+
+	switch (SIM.mode) {
+		case SIM_ID:
+			if (SIM.column < sizeof(SIM.id))
+				data = SIM.id[SIM.column];
+			SIM.column++;
+			break;
+		case SIM_READ:
+			/* Small page devices sense right after the address */
+			if (!SIM.sensed)
+				_sim_sense();
+			if (SIM.column < SIM.raw_page_size)
+				data = SIM.reg[SIM.column];
+			SIM.column++;
+			break;
+		case SIM_STATUS:
+			data = SIM.status_fail;
+			if (_sim_ready())
+				data |= NS_ARDY | NS_RDY;
+			/* Not write protected */
+			data |= 0x80;
+			break;
+		default:
+			break;
+	}
+
+	return data;
+}
+
+void nand_io_read_buf(uint8_t *buffer, uint32_t len)
+{
+	uint32_t offset;
+
+	for (offset = 0; offset < len; offset++)
+		buffer[offset] = nand_io_read();
+}
+
+void nand_io_set(uint8_t data)
+{
+	if (SIM.ale) {
+		if (SIM.addr_len < SIM_ADDR_MAX)
+			SIM.addr[SIM.addr_len++] = data;
+		return;
+	}
+
+	if (SIM.mode == SIM_PROG) {
+		if (SIM.column == 0 && SIM.addr_len)
+			_sim_decode_addr();
+		if (SIM.column < SIM.raw_page_size)
+			SIM.reg[SIM.column] = data;
+		SIM.column++;
+	}
+}
+
+int nand_wait_rb(void)
+{
+	while (!_sim_ready())
+		usleep(10);
+
+	return 1;
+}
+
+void nand_we(void)
+{
+}
@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: MIT
+
+#if !defined(_PRIVATE_H_)
+#define _PRIVATE_H_
+
+#include <stdint.h>
+
+uint32_t micros(void);
+uint32_t millis(void);
+
+void serial_begin(void);
+void serial_end(void);
+
+void nand_host_init(void);
+
+#endif /* _PRIVATE_H_ */
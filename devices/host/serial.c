@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "device.h"
+#include "private.h"
+
+#define SERIAL_TIMEOUT_MS	1000
+
+int serial_fd = -1;
+int serial_peer = -1;
+
+void serial_begin(void)
+{
+	struct termios tio;
+	const char *link = getenv("NAND_IO_PTY");
+	char *name;
+
+	serial_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (serial_fd < 0 || grantpt(serial_fd) || unlockpt(serial_fd)) {
+		perror("host: pty");
+		exit(1);
+	}
+
+	name = ptsname(serial_fd);
+
+	/* Keep a peer open so the master never sees a hangup */
+	serial_peer = open(name, O_RDWR | O_NOCTTY);
+	tcgetattr(serial_peer, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(serial_peer, TCSANOW, &tio);
+
+	if (link) {
+		unlink(link);
+		if (symlink(name, link))
+			perror("host: symlink");
+	}
+
+	printf("%s\n", name);
+	fflush(stdout);
+}
+
+void serial_end(void)
+{
+	close(serial_peer);
+	close(serial_fd);
+}
+
+int serial_available(void)
+{
+	struct pollfd pfd = {
+		.fd = serial_fd,
+		.events = POLLIN,
+	};
+
+	if (poll(&pfd, 1, 1) > 0 && (pfd.revents & POLLIN))
+		return 1;
+
+	return 0;
+}
+
+int serial_busy(void)
+{
+	return 0;
+}
+
+void serial_flush_input(void)
+{
+}
+
+void serial_flush_output(void)
+{
+}
+
+uint32_t serial_get_baud(void)
+{
+	return 0;
+}
+
+size_t serial_read(void *ptr, size_t size)
+{
+	uint8_t *buffer = ptr;
+	uint32_t read_ms = millis();
+	size_t count = 0;
+
+	while (count < size) {
+		struct pollfd pfd = {
+			.fd = serial_fd,
+			.events = POLLIN,
+		};
+		int timeout = SERIAL_TIMEOUT_MS - (millis() - read_ms);
+		ssize_t len;
+
+		if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0)
+			break;
+
+		len = read(serial_fd, buffer + count, size - count);
+		if (len <= 0)
+			break;
+
+		count += len;
+	}
+
+	return count;
+}
+
+size_t serial_write(const void *ptr, size_t size)
+{
+	const uint8_t *buffer = ptr;
+	size_t count = 0;
+
+	while (count < size) {
+		ssize_t len = write(serial_fd, buffer + count, size - count);
+
+		if (len <= 0)
+			break;
+
+		count += len;
+	}
+
+	return count;
+}
@@ -14,7 +14,9 @@
 uint16_t bswap16(uint16_t value);
 uint32_t bswap32(uint32_t value);
 
-#if defined(__BIG_ENDIAN__)
+#if defined(le16toh)
+    /* Provided by the host C library */
+#elif defined(__BIG_ENDIAN__)
     #define be16toh(x) (x)
     #define be32toh(x) (x)
     #define htobe16(x) (x)
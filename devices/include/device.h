@@ -31,6 +31,7 @@ void nand_enable(void);
 void nand_io_in(void);
 void nand_io_out(void);
 uint8_t nand_io_read(void);
+void nand_io_read_buf(uint8_t *buffer, uint32_t len);
 void nand_io_set(uint8_t data);
 int nand_wait_rb(void);
 void nand_we(void);
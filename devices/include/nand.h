@@ -7,6 +7,7 @@
 
 #define NC_READ1	0x00
 #define NC_PAGE_P2	0x10
+#define NC_CACHE_P2	0x15
 #define NC_READ2	0x30
 #define NC_ERASE1	0x60
 #define NC_STATUS	0x70
@@ -15,9 +16,26 @@
 #define NC_ERASE2	0xD0
 #define NC_RESET	0xFF
 
+#define NS_FAIL		0x01
+#define NS_FAILC	0x02
+#define NS_ARDY		0x20
+#define NS_RDY		0x40
+
 #define RB_TOUT_MS	3000
 
+#define VOTE_CHUNK_SIZE	528
+#define VOTE_COUNT_BITS	3
+
+uint8_t nand_erase_block(const nand_addr_rx *block, int wait);
+int nand_erase_finish(void);
+void nand_page_abort(void);
+uint8_t nand_page_program(int cache);
+int nand_pending(void);
 int nand_read_id(nand_id_tx *nand_id);
 int nand_read_page(const nand_addr_rx *page, uint8_t *buffer, uint32_t len, int set);
+uint32_t nand_read_page_vote(const nand_addr_rx *page, uint32_t column,
+			     uint8_t *buffer, uint32_t len, uint8_t reads);
+uint8_t nand_status(void);
+int nand_write_page(const nand_addr_rx *page, const uint8_t *buffer, uint32_t len, int set);
 
 #endif /* _NAND_H_ */
@@ -5,11 +5,13 @@
 
 #define PACKED __attribute__((packed))
 
-#define PROTOCOL_VERSION 1
+#define PROTOCOL_VERSION 3
 
 typedef enum {
 	DEV_UNKNOWN = 0,
 	DEV_TEENSYPP2 = 1,
+	DEV_EMULATOR = 2,
+	DEV_HOST = 3,
 } dev_id_t;
 
 typedef enum {
@@ -23,6 +25,8 @@ typedef enum {
 	CMD_NAND_PAGE_READ = 0x32,
 	CMD_NAND_PAGE_WRITE = 0x33,
 	CMD_NAND_BLOCK_ERASE = 0x34,
+	CMD_NAND_PAGE_READ_VOTE = 0x35,
+	CMD_NAND_STATUS = 0x36,
 	/* Error */
 	CMD_ERROR = 0xF0,
 } cmd_id_t;
@@ -54,6 +58,7 @@ typedef struct {
 	uint32_t raw_page_size;
 	uint32_t read_delay_us;
 	uint8_t pull_up;
+	uint8_t re_delay_nops;
 } PACKED nand_cfg_rx;
 
 typedef struct {
@@ -64,11 +69,40 @@ typedef struct {
 	uint8_t plane_data;
 } PACKED nand_id_tx;
 
+#define NAND_PAGE_CACHE 0x01
+typedef struct {
+	nand_addr_rx addr;
+	uint8_t flags;
+} PACKED nand_page_write_rx;
+
+#define NAND_ERASE_NOWAIT 0x01
+typedef struct {
+	nand_addr_rx addr;
+	uint8_t flags;
+} PACKED nand_block_erase_rx;
+
+#define NAND_STATUS_ERASE_FAIL 0x01
+typedef struct {
+	uint8_t status;
+	uint8_t flags;
+} PACKED nand_status_tx;
+
+#define NAND_VOTE_MAX_READS 7
+typedef struct {
+	nand_addr_rx addr;
+	uint8_t reads;
+} PACKED nand_page_vote_rx;
+
+typedef struct {
+	uint32_t unstable_bits;
+} PACKED nand_vote_tx;
+
 typedef struct {
 	uint8_t device;
 	uint16_t version;
 	uint32_t serial_speed;
 	uint32_t memory_free;
+	uint32_t resyncs;
 } PACKED ping_tx;
 
 typedef struct {
@@ -86,6 +86,43 @@ uint8_t nand_io_read(void)
 	return data;
 }
 
+#define NAND_IO_READ_LOOP(cycles) \
+	for (offset = 0; offset < len; offset++) { \
+		PORT_RE = 0; \
+		__builtin_avr_delay_cycles(cycles); \
+		buffer[offset] = PIN_IO; \
+		PORT_RE = 0xFF; \
+	}
+
+void nand_io_read_buf(uint8_t *buffer, uint32_t len)
+{
+	const uint8_t nops = NAND.re_delay_nops;
+	uint32_t offset;
+
+	/*
+	 * RE# low time, tuned by the host. The delay is picked once per
+	 * transfer, rounded up to a fixed cycle count, so the byte loop
+	 * doesn't pay for it.
+	 */
+	if (nops == 0) {
+		for (offset = 0; offset < len; offset++) {
+			PORT_RE = 0;
+			buffer[offset] = PIN_IO;
+			PORT_RE = 0xFF;
+		}
+	} else if (nops == 1) {
+		NAND_IO_READ_LOOP(1);
+	} else if (nops == 2) {
+		NAND_IO_READ_LOOP(2);
+	} else if (nops <= 4) {
+		NAND_IO_READ_LOOP(4);
+	} else if (nops <= 8) {
+		NAND_IO_READ_LOOP(8);
+	} else {
+		NAND_IO_READ_LOOP(16);
+	}
+}
+
 void nand_io_set(uint8_t data)
 {
 	PORT_IO = data;
@@ -4,9 +4,22 @@
 import argparse
 
 from .common import auto_int
-from .const import SERIAL_DEF_SPEED
+from .const import (
+    COMPRESS_AUTO,
+    COMPRESS_GZIP,
+    COMPRESS_XZ,
+    COMPRESS_ZSTD,
+    METRICS_FORMAT_JSON,
+    METRICS_FORMAT_PROMETHEUS,
+    MULTI_MODE_EACH,
+    MULTI_MODE_SPLIT,
+    SERIAL_DEF_SPEED,
+)
 from .interface import NandIO
 from .logger import INFO
+from .metrics import ReadMetrics
+from .multi import MultiNandIO, discover_devices
+from .protocol import NAND_VOTE_MAX_READS
 
 
 def main():
@@ -20,6 +33,32 @@ def main():
         help="Force device bootloader",
     )
 
+    parser.add_argument(
+        "--metrics",
+        dest="metrics",
+        action="store",
+        type=str,
+        help="NAND read metrics export file",
+    )
+
+    parser.add_argument(
+        "--metrics-format",
+        dest="metrics_format",
+        action="store",
+        choices=[METRICS_FORMAT_JSON, METRICS_FORMAT_PROMETHEUS],
+        default=METRICS_FORMAT_JSON,
+        help="NAND read metrics as JSON lines or a Prometheus textfile",
+    )
+
+    parser.add_argument(
+        "--multi-mode",
+        dest="multi_mode",
+        action="store",
+        choices=[MULTI_MODE_SPLIT, MULTI_MODE_EACH],
+        default=MULTI_MODE_SPLIT,
+        help="Multiple devices: split one NAND read or read each NAND to FILE.N",
+    )
+
     parser.add_argument(
         "--pull-up",
         dest="pull_up",
@@ -35,6 +74,63 @@ def main():
         help="NAND read",
     )
 
+    parser.add_argument(
+        "--read-compress",
+        dest="nand_read_compress",
+        action="store",
+        nargs="?",
+        const=COMPRESS_AUTO,
+        choices=[COMPRESS_AUTO, COMPRESS_ZSTD, COMPRESS_XZ, COMPRESS_GZIP],
+        help="NAND read into a compressed dump with a frame per block",
+    )
+
+    parser.add_argument(
+        "--read-container",
+        dest="nand_read_container",
+        action="store_true",
+        help="NAND read into an indexed container instead of a raw dump",
+    )
+
+    parser.add_argument(
+        "--read-ecc",
+        dest="nand_read_ecc",
+        action="store_true",
+        help="NAND read with ECC correction, bit flips are listed in a .ecc report",
+    )
+
+    parser.add_argument(
+        "--read-logical",
+        dest="nand_read_logical",
+        metavar="FILE",
+        action="store",
+        type=str,
+        help="NAND read bad block aware, also writing the good blocks to FILE",
+    )
+
+    parser.add_argument(
+        "--read-sparse",
+        dest="nand_read_sparse",
+        action="store_true",
+        help="NAND read blank pages as file holes listed in a .blank bitmap,"
+        " read back as 0x00 by tools other than NAND IO",
+    )
+
+    parser.add_argument(
+        "--read-store",
+        dest="nand_read_store",
+        action="store",
+        type=str,
+        help="NAND read into a content-addressed page store, FILE is the manifest",
+    )
+
+    parser.add_argument(
+        "--read-votes",
+        dest="nand_read_votes",
+        action="store",
+        type=auto_int,
+        help="NAND read majority votes per page (1-%d)" % NAND_VOTE_MAX_READS,
+    )
+
     parser.add_argument(
         "--restart",
         dest="restart",
@@ -42,12 +138,26 @@ def main():
         help="Force device restart",
     )
 
+    parser.add_argument(
+        "--resume",
+        dest="nand_read_resume",
+        action="store_true",
+        help="NAND read resume, only missing pages are read",
+    )
+
     parser.add_argument(
         "--serial-device",
         dest="serial_device",
-        action="store",
+        action="append",
         type=str,
-        help="Serial device",
+        help="Serial device (repeat for multiple devices)",
+    )
+
+    parser.add_argument(
+        "--serial-discover",
+        dest="serial_discover",
+        action="store_true",
+        help="Use every connected NAND IO serial device",
     )
 
     parser.add_argument(
@@ -58,6 +168,21 @@ def main():
         help="Serial speed",
     )
 
+    parser.add_argument(
+        "--serve",
+        dest="serve",
+        action="store",
+        type=str,
+        help="Share the device with local clients on a Unix socket",
+    )
+
+    parser.add_argument(
+        "--tune-timing",
+        dest="tune_timing",
+        action="store_true",
+        help="Tune and cache the fastest reliable read timing",
+    )
+
     parser.add_argument(
         "--write",
         dest="nand_write",
@@ -66,20 +191,73 @@ def main():
         help="NAND write",
     )
 
+    parser.add_argument(
+        "--write-base",
+        dest="nand_write_base",
+        action="store",
+        type=str,
+        help="NAND raw dump of the current contents, erases of its blank blocks"
+        " are skipped once they read back blank",
+    )
+
     args = parser.parse_args()
 
-    if not args.serial_device:
+    serial_devices = args.serial_device or []
+    if args.serial_discover:
+        serial_devices += [
+            device for device in discover_devices() if device not in serial_devices
+        ]
+    if not serial_devices:
         parser.print_help()
         return
     if not args.pull_up:
         args.pull_up = False
     if not args.serial_speed:
         args.serial_speed = SERIAL_DEF_SPEED
+    if args.nand_read_votes is None:
+        args.nand_read_votes = 1
+    if not 1 <= args.nand_read_votes <= NAND_VOTE_MAX_READS:
+        parser.print_help()
+        return
+
+    if len(serial_devices) > 1:
+        # Bad blocks are only scanned on a single device
+        if not args.nand_read or args.nand_read_logical:
+            parser.print_help()
+            return
+        multi = MultiNandIO(
+            serial_devices,
+            logger_level=INFO,
+            pull_up=args.pull_up,
+            serial_speed=args.serial_speed,
+        )
+        if multi.open():
+            if args.multi_mode == MULTI_MODE_EACH:
+                read = multi.read_each
+            else:
+                read = multi.read_split
+            read(
+                file=args.nand_read,
+                votes=args.nand_read_votes,
+                resume=args.nand_read_resume,
+                sparse=args.nand_read_sparse,
+                container=args.nand_read_container,
+                ecc=args.nand_read_ecc,
+                compress=args.nand_read_compress,
+                store=args.nand_read_store,
+                metrics=ReadMetrics(
+                    multi.log,
+                    export=args.metrics,
+                    export_format=args.metrics_format,
+                ),
+            )
+        multi.close()
+        return
 
     nand = NandIO(
         logger_level=INFO,
         pull_up=args.pull_up,
-        serial_device=args.serial_device,
+        serial_device=serial_devices[0],
         serial_speed=args.serial_speed,
     )
     if nand:
@@ -89,12 +267,33 @@ def main():
                     nand.bootloader()
                 elif args.restart:
                     nand.restart()
+                elif args.tune_timing:
+                    nand.show_info()
+                    nand.tune_timing()
                 elif args.nand_read:
                     nand.show_info()
-                    nand.read(file=args.nand_read)
+                    nand.read(
+                        file=args.nand_read,
+                        votes=args.nand_read_votes,
+                        resume=args.nand_read_resume,
+                        sparse=args.nand_read_sparse,
+                        container=args.nand_read_container,
+                        ecc=args.nand_read_ecc,
+                        compress=args.nand_read_compress,
+                        store=args.nand_read_store,
+                        logical=args.nand_read_logical,
+                        metrics=ReadMetrics(
+                            nand.log,
+                            export=args.metrics,
+                            export_format=args.metrics_format,
+                        ),
+                    )
                 elif args.nand_write:
                     nand.show_info()
-                    nand.write(file=args.nand_write)
+                    nand.write(file=args.nand_write, base=args.nand_write_base)
+                elif args.serve:
+                    nand.show_info()
+                    nand.serve(args.serve)
                 else:
                     nand.show_info()
         nand.close()
@@ -0,0 +1,111 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO page store archive."""
+
+import argparse
+import sys
+
+from .logger import INFO, Logger
+from .store import StoreManifest, store_to_raw
+
+
+def page_ranges(pages):
+    """Sorted pages as a compact range list."""
+    ranges = []
+    for page in pages:
+        if ranges and ranges[-1][1] == page - 1:
+            ranges[-1][1] = page
+        else:
+            ranges.append([page, page])
+    return ",".join(
+        str(first) if first == last else "%d-%d" % (first, last)
+        for first, last in ranges
+    )
+
+
+def main():
+    """NAND IO page store archive."""
+    parser = argparse.ArgumentParser(description="")
+
+    parser.add_argument(
+        "--diff",
+        dest="diff",
+        nargs="+",
+        metavar="MANIFEST",
+        help="Compare dump manifests against the first one (golden)",
+    )
+
+    parser.add_argument(
+        "--pages",
+        dest="pages",
+        action="store_true",
+        help="List the differing pages",
+    )
+
+    parser.add_argument(
+        "--store",
+        dest="store",
+        action="store",
+        type=str,
+        help="Page store directory",
+    )
+
+    parser.add_argument(
+        "--to-raw",
+        dest="to_raw",
+        nargs=2,
+        metavar=("MANIFEST", "RAW"),
+        help="Rebuild a raw dump from a manifest",
+    )
+
+    args = parser.parse_args()
+    log = Logger(level=INFO, stream=sys.stdout)
+
+    if args.to_raw:
+        if not args.store:
+            parser.print_help()
+            return 2
+        if not StoreManifest(args.to_raw[0]).load().complete:
+            log.error("%s: incomplete read, not rebuilt\n", args.to_raw[0])
+            return 1
+        missing = store_to_raw(args.to_raw[0], args.store, args.to_raw[1])
+        if missing:
+            log.warning(
+                "%d pages missing from %s, left 0xFF: %s\n",
+                len(missing),
+                args.to_raw[0],
+                page_ranges(missing),
+            )
+            return 1
+    elif args.diff and len(args.diff) > 1:
+        golden = StoreManifest(args.diff[0]).load()
+        if not golden.complete:
+            log.warning("%s: incomplete read\n", args.diff[0])
+        for file in args.diff[1:]:
+            manifest = StoreManifest(file).load()
+            if not manifest.same_chip(golden):
+                log.error("%s: different NAND\n", file)
+                continue
+            if not manifest.complete:
+                log.warning("%s: incomplete read\n", file)
+            pages = manifest.diff(golden)
+            if not pages:
+                log.info("%s: identical\n", file)
+                continue
+            blocks = sorted({page // golden.block_pages for page in pages})
+            log.info(
+                "%s: %d pages differ in %d blocks (%s)\n",
+                file,
+                len(pages),
+                len(blocks),
+                page_ranges(blocks),
+            )
+            if args.pages:
+                log.info("\tPages: %s\n", page_ranges(pages))
+    else:
+        parser.print_help()
+        return 2
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,224 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO bad block map."""
+
+import json
+import os
+
+from .const import (
+    BBT_BLOCK_GOOD,
+    BBT_BLOCK_RESERVED,
+    BBT_MAP_SUFFIX,
+    BBT_MAP_VERSION,
+    BBT_MAX_BLOCKS,
+    BBT_PATTERN_MAIN,
+    BBT_PATTERN_MIRROR,
+    BBT_PATTERN_OFFSET,
+    BBT_SOURCE_BBT,
+    BBT_SOURCE_MARKERS,
+    BBT_VERSION_OFFSET,
+    NM_BAD_BLOCK_POS,
+)
+from .stream import PageStream
+
+
+def bad_block_pos(nand):
+    """OOB offsets of the factory bad block marker."""
+    if nand.layout and NM_BAD_BLOCK_POS in nand.layout:
+        return nand.layout[NM_BAD_BLOCK_POS]
+    # Linux defaults, byte 5 on small page and byte 0 on large page chips
+    if nand.page_size == 512:
+        return [5]
+    return [0]
+
+
+def bbt_parse(table, blocks):
+    """Bad and reserved blocks of a Linux MTD 2 bit per block table."""
+    bad = []
+    reserved = []
+    for block in range(blocks):
+        code = (table[block >> 2] >> ((block & 3) * 2)) & 0x03
+        if code == BBT_BLOCK_RESERVED:
+            reserved.append(block)
+        elif code != BBT_BLOCK_GOOD:
+            bad.append(block)
+    return bad, reserved
+
+
+class BadBlockMap:
+    """Bad block map.
+
+    Bad blocks aren't read. Reserved blocks, the ones holding an on-flash
+    bad block table, are read but left out of logical images like Linux
+    does. Saved as a JSON sidecar next to the dump.
+    """
+
+    def __init__(self, nand, source, bad, reserved=None, bbt_version=None):
+        """Init bad block map."""
+        self.nand = nand
+        self.source = source
+        self.bad = set(bad)
+        self.reserved = set(reserved or []) - self.bad
+        self.bbt_version = bbt_version
+
+        # Logical block of every physical block, None if skipped
+        self.logical = []
+        self.good = 0
+        for block in range(nand.blocks):
+            if block in self.bad or block in self.reserved:
+                self.logical.append(None)
+            else:
+                self.logical.append(self.good)
+                self.good += 1
+
+    def is_bad(self, block):
+        """Check if a block is bad."""
+        return block in self.bad
+
+    def save(self, file):
+        """Write the map next to a dump."""
+        header = {
+            "version": BBT_MAP_VERSION,
+            "source": self.source,
+            "bbt_version": self.bbt_version,
+            "blocks": self.nand.blocks,
+            "block_pages": self.nand.block_pages,
+            "bad": sorted(self.bad),
+            "reserved": sorted(self.reserved),
+        }
+        tmp_file = file + BBT_MAP_SUFFIX + ".tmp"
+        with open(tmp_file, "w", encoding="utf-8") as bbt_map:
+            json.dump(header, bbt_map, indent=1)
+        os.replace(tmp_file, file + BBT_MAP_SUFFIX)
+
+
+class BadBlockScan:
+    """Bad block scan before a dump.
+
+    Looks for a Linux MTD bad block table in the first page of the last
+    blocks, the newest of the main and mirror copies being used. Without
+    one, the factory markers in the OOB of the first two pages of every
+    block are checked. Pages read by the scan are kept, so they don't have
+    to be read again by the dump.
+    """
+
+    def __init__(self, nand_io):
+        """Init bad block scan."""
+        self.nand_io = nand_io
+        self.log = nand_io.log
+        self.nand = nand_io.nand
+        self.scanned = {}
+
+    def read(self, pages):
+        """Read pages through a pipelined stream."""
+        pages = [page for page in pages if page not in self.scanned]
+        for page, data, oob in PageStream(self.nand_io, pages):
+            self.scanned[page] = bytes(data) + bytes(oob)
+
+    def find_bbt(self):
+        """First page and version of the newest table, None if missing."""
+        nand = self.nand
+        first = max(nand.blocks - BBT_MAX_BLOCKS, 0)
+        pages = [block * nand.block_pages for block in range(first, nand.blocks)]
+        self.read(pages)
+
+        found = {}
+        for page in pages:
+            oob = self.scanned[page][nand.page_size :]
+            pattern = oob[BBT_PATTERN_OFFSET : BBT_PATTERN_OFFSET + 4]
+            if pattern in (BBT_PATTERN_MAIN, BBT_PATTERN_MIRROR):
+                found.setdefault(oob[BBT_VERSION_OFFSET], page)
+        if not found:
+            return None
+        version = max(found)
+        return found[version], version
+
+    def read_bbt(self, page, version):
+        """Bad block map from an on-flash table."""
+        nand = self.nand
+        size = (nand.blocks * 2 + 7) // 8
+        count = (size + nand.page_size - 1) // nand.page_size
+        self.read(range(page, page + count))
+        table = b"".join(
+            self.scanned[table_page][: nand.page_size]
+            for table_page in range(page, page + count)
+        )
+
+        # Like Linux, every block the table may be in is reserved
+        first = max(nand.blocks - BBT_MAX_BLOCKS, 0)
+        bad, reserved = bbt_parse(table, nand.blocks)
+        reserved = set(reserved) | set(range(first, nand.blocks))
+        return BadBlockMap(nand, BBT_SOURCE_BBT, bad, reserved, version)
+
+    def scan_markers(self):
+        """Bad block map from the factory markers."""
+        nand = self.nand
+        pages = []
+        for block in range(nand.blocks):
+            first = block * nand.block_pages
+            pages += range(first, first + min(nand.block_pages, 2))
+        self.read(pages)
+
+        bad = set()
+        positions = [nand.page_size + pos for pos in bad_block_pos(nand)]
+        for page in pages:
+            raw = self.scanned[page]
+            if any(raw[pos] != 0xFF for pos in positions):
+                bad.add(page // nand.block_pages)
+        return BadBlockMap(nand, BBT_SOURCE_MARKERS, bad)
+
+    def run(self):
+        """Scan for bad blocks, None on read errors."""
+        try:
+            found = self.find_bbt()
+            if found:
+                bad_blocks = self.read_bbt(*found)
+                self.log.info(
+                    "Bad block table: page %d, version %d\n", found[0], found[1]
+                )
+            else:
+                bad_blocks = self.scan_markers()
+        except IOError:
+            self.log.error("Error scanning bad blocks!\n")
+            return None
+
+        self.log.info(
+            "Bad blocks: %d (%s), %d reserved\n",
+            len(bad_blocks.bad),
+            bad_blocks.source,
+            len(bad_blocks.reserved),
+        )
+        return bad_blocks
+
+
+class LogicalImage:
+    """Page data of the good blocks, bad and reserved blocks skipped."""
+
+    def __init__(self, file, nand, bad_blocks, resume=False):
+        """Open logical image."""
+        self.nand = nand
+        self.bad_blocks = bad_blocks
+        if resume and os.path.exists(file):
+            self.out = open(file, "r+b")
+        else:
+            self.out = open(file, "wb")
+
+    def close(self):
+        """Close logical image."""
+        # Blank trailing pages are still part of the image
+        self.out.truncate(self.bad_blocks.good * self.nand.block_size)
+        self.out.close()
+
+    def flush(self):
+        """Write logical image to disk."""
+        self.out.flush()
+        os.fsync(self.out.fileno())
+
+    def store_page(self, page, data):
+        """Store the data of a page of a good block."""
+        nand = self.nand
+        block, index = divmod(page, nand.block_pages)
+        logical = self.bad_blocks.logical[block]
+        if logical is None:
+            return
+        self.out.seek(logical * nand.block_size + index * nand.page_size)
+        self.out.write(data[: nand.page_size])
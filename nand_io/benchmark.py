@@ -0,0 +1,226 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO host benchmarks."""
+
+import argparse
+import ctypes
+import io
+import os
+import time
+
+from .const import NAND_LAYOUT_LP_BCH4, NAND_LAYOUT_SP_HAMMING, NAND_PAGE_ADDR_4B
+from .crc import (
+    CRC16_START,
+    CRC32_START,
+    crc16,
+    crc16_table,
+    crc32,
+    crc32_table,
+    crc_self_check,
+)
+from .ecc import EccEngine
+from .emulator import Emulator
+from .interface import NandIO
+from .logger import ERROR
+from .nand import Nand
+from .output import ReadOutput
+from .pipeline import ReadPipeline
+from .protocol import (
+    CMD_NAND_PAGE_READ,
+    PKT_CRC16_STRUCT,
+    PKT_CRC32_STRUCT,
+    PKT_HDR_STRUCT,
+    PKT_MAGIC,
+    IONandAddressTX,
+)
+
+BENCH_PAGE_SIZE = 2112
+BENCH_PAGES = 4096
+
+
+class LoopbackPort:
+    """In-process port answering page reads with a canned packet."""
+
+    def __init__(self, page_size):
+        """Init loopback port."""
+        hdr_len = PKT_HDR_STRUCT.size
+        data_offset = hdr_len + PKT_CRC16_STRUCT.size
+        data = os.urandom(page_size)
+
+        pkt = bytearray(data_offset + page_size + PKT_CRC32_STRUCT.size)
+        PKT_HDR_STRUCT.pack_into(pkt, 0, PKT_MAGIC, CMD_NAND_PAGE_READ, page_size)
+        PKT_CRC16_STRUCT.pack_into(pkt, hdr_len, crc16(CRC16_START, pkt, hdr_len))
+        pkt[data_offset : data_offset + page_size] = data
+        PKT_CRC32_STRUCT.pack_into(
+            pkt, data_offset + page_size, crc32(CRC32_START, data, page_size)
+        )
+        self.pkt = bytes(pkt)
+
+        self.request_len = (
+            data_offset + ctypes.sizeof(IONandAddressTX) + PKT_CRC32_STRUCT.size
+        )
+        self.received = 0
+        self.pending = 0
+        self.offset = 0
+
+    def close(self):
+        """Close port."""
+
+    def flush(self):
+        """Flush port."""
+
+    def readinto(self, buffer):
+        """Copy queued responses into buffer."""
+        view = memoryview(buffer)
+        length = 0
+        while length < len(view) and self.pending:
+            chunk = min(len(view) - length, len(self.pkt) - self.offset)
+            view[length : length + chunk] = self.pkt[self.offset : self.offset + chunk]
+            length += chunk
+            self.offset += chunk
+            if self.offset == len(self.pkt):
+                self.offset = 0
+                self.pending -= 1
+        return length
+
+    def write(self, data):
+        """Queue a response for every complete request."""
+        self.received += len(data)
+        while self.received >= self.request_len:
+            self.received -= self.request_len
+            self.pending += 1
+        return len(data)
+
+
+def bench_rate(func, data, seconds):
+    """Run func over data for about the given time and return MB/s."""
+    done = 0
+    start = time.perf_counter()
+    elapsed = 0.0
+    while elapsed < seconds:
+        func(data)
+        done += len(data)
+        elapsed = time.perf_counter() - start
+    return done / elapsed / (1024 * 1024)
+
+
+def bench_crc(seconds):
+    """CRC throughput over page sized buffers."""
+    data = os.urandom(BENCH_PAGE_SIZE)
+    _len = len(data)
+
+    print("CRC self check: %s" % ("OK" if crc_self_check() else "FAILED"))
+    results = [
+        ("crc16", lambda d: crc16(CRC16_START, d, _len)),
+        ("crc16 (table)", lambda d: crc16_table(CRC16_START, d, _len)),
+        ("crc32", lambda d: crc32(CRC32_START, d, _len)),
+        ("crc32 (table)", lambda d: crc32_table(CRC32_START, d, _len)),
+    ]
+    for name, func in results:
+        print("%-16s %10.2f MB/s" % (name, bench_rate(func, data, seconds)))
+
+
+def bench_ecc(seconds):
+    """ECC correction throughput over clean pages."""
+    results = [
+        ("hamming 512+16", EccEngine(NAND_LAYOUT_SP_HAMMING, 512, 16)),
+        ("bch4 2048+64", EccEngine(NAND_LAYOUT_LP_BCH4, 2048, 64)),
+    ]
+    for name, engine in results:
+        data = bytearray(os.urandom(engine.page_size) + b"\xff" * engine.oob_size)
+        engine.calculate(data)
+        print("%-16s %10.2f MB/s" % (name, bench_rate(engine.correct, data, seconds)))
+
+
+def bench_packets(pages):
+    """Host CPU time spent per MB on the page read packet path."""
+    nand_io = NandIO(
+        serial_device=LoopbackPort(BENCH_PAGE_SIZE),
+        logger_level=ERROR,
+        logger_stream=io.StringIO(),
+    )
+    nand_io.open()
+
+    nand = Nand(nand_io.log)
+    nand.page_addr_type = NAND_PAGE_ADDR_4B
+    nand.raw_page_size = BENCH_PAGE_SIZE
+    nand.pages = pages
+    nand_io.nand = nand
+
+    output = ReadOutput(nand_io.log, nand)
+    output.out = open(os.devnull, "wb")
+    start = time.process_time()
+    res = ReadPipeline(nand_io, output).run()
+    elapsed = time.process_time() - start
+    output.close(res)
+    nand_io.close()
+
+    size = pages * BENCH_PAGE_SIZE / (1024 * 1024)
+    print("Packet read: %s" % ("OK" if res else "FAILED"))
+    print("%-16s %10.2f ms/MB" % ("CPU time", elapsed * 1000 / size))
+
+
+def bench_emulator(pages, bandwidth):
+    """Read throughput against the in-process device emulator."""
+    nand_io = NandIO(
+        serial_device=Emulator(bandwidth=bandwidth),
+        logger_level=ERROR,
+        logger_stream=io.StringIO(),
+    )
+    nand_io.open()
+    nand_io.ping()
+    nand_io.show_info()
+    pages = min(pages, nand_io.nand.pages)
+
+    output = ReadOutput(nand_io.log, nand_io.nand)
+    output.out = open(os.devnull, "wb")
+    start = time.perf_counter()
+    res = ReadPipeline(nand_io, output, pages=range(pages)).run()
+    elapsed = time.perf_counter() - start
+    output.close(res)
+    nand_io.close()
+
+    size = pages * nand_io.nand.raw_page_size / (1024 * 1024)
+    print("Emulator read: %s" % ("OK" if res else "FAILED"))
+    print("%-16s %10.2f MB/s" % ("Throughput", size / elapsed))
+
+
+def main():
+    """NAND IO benchmarks."""
+    parser = argparse.ArgumentParser(description="")
+
+    parser.add_argument(
+        "--emulator-bandwidth",
+        dest="emulator_bandwidth",
+        action="store",
+        type=int,
+        default=0,
+        help="Emulator USB bandwidth in bytes/s (0 for unlimited)",
+    )
+
+    parser.add_argument(
+        "--seconds",
+        dest="seconds",
+        action="store",
+        type=float,
+        default=1.0,
+        help="Time spent on each benchmark",
+    )
+    parser.add_argument(
+        "--pages",
+        dest="pages",
+        action="store",
+        type=int,
+        default=BENCH_PAGES,
+        help="Pages read by the packet benchmark",
+    )
+
+    args = parser.parse_args()
+
+    bench_crc(args.seconds)
+    bench_ecc(args.seconds)
+    bench_packets(args.pages)
+    bench_emulator(args.pages, args.emulator_bandwidth)
+
+
+if __name__ == "__main__":
+    main()
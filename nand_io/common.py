@@ -10,6 +10,52 @@ def auto_int(int_arg):
     return int(int_arg, 0)
 
 
+def add_nand_id_arg(parser):
+    """Add NAND ID argument of raw dumps."""
+    parser.add_argument(
+        "--id",
+        dest="nand_id",
+        type=bytes.fromhex,
+        metavar="HEX",
+        help="NAND ID bytes of a raw dump, for its geometry and OOB layout",
+    )
+
+
+def add_raw_geometry_args(parser, *, block_pages=False):
+    """Add raw dump page geometry arguments."""
+    parser.add_argument(
+        "--page-size",
+        dest="page_size",
+        action="store",
+        type=auto_int,
+        help="Raw dump page size",
+    )
+
+    parser.add_argument(
+        "--oob-size",
+        dest="oob_size",
+        action="store",
+        type=auto_int,
+        help="Raw dump OOB size",
+    )
+
+    if block_pages:
+        parser.add_argument(
+            "--block-pages",
+            dest="block_pages",
+            action="store",
+            type=auto_int,
+            help="Raw dump pages per block",
+        )
+
+
+def convert_duration(seconds):
+    """Convert seconds to H:MM:SS."""
+    minutes, seconds = divmod(int(seconds), 60)
+    hours, minutes = divmod(minutes, 60)
+    return "%d:%02d:%02d" % (hours, minutes, seconds)
+
+
 def convert_size(size_bytes):
     """Convert size to human readable."""
     if size_bytes is None or size_bytes == 0:
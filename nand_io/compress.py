@@ -0,0 +1,403 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO compressed dump."""
+
+import ctypes
+import gzip
+import os
+import queue
+import struct
+import threading
+import time
+
+from .const import (
+    COMPRESS_AUTO,
+    COMPRESS_CODECS,
+    COMPRESS_GZIP,
+    COMPRESS_LEVELS,
+    COMPRESS_MAGIC,
+    COMPRESS_QUEUE_BLOCKS,
+    COMPRESS_THREADS,
+    COMPRESS_VERSION,
+    COMPRESS_XZ,
+    COMPRESS_ZSTD,
+)
+from .crc import CRC32_START, crc32
+
+try:
+    import lzma
+except ImportError:
+    lzma = None  # type: ignore
+
+try:
+    import zstandard
+except ImportError:
+    zstandard = None
+
+COMPRESS_INDEX_STRUCT = struct.Struct("<QII")
+
+MB = 1024 * 1024
+
+
+class CompressedHeader(ctypes.LittleEndianStructure):
+    """Compressed dump header."""
+
+    _pack_ = 1
+    _fields_ = [
+        ("magic", ctypes.c_char * 4),
+        ("version", ctypes.c_uint8),
+        ("codec", ctypes.c_uint8),
+        ("header_size", ctypes.c_uint16),
+        ("mf_id", ctypes.c_uint8),
+        ("dev_id", ctypes.c_uint8),
+        ("reserved", ctypes.c_uint16),
+        ("page_size", ctypes.c_uint32),
+        ("oob_size", ctypes.c_uint32),
+        ("block_pages", ctypes.c_uint32),
+        ("pages", ctypes.c_uint32),
+        ("frames", ctypes.c_uint32),
+        ("index_offset", ctypes.c_uint64),
+    ]
+
+
+def codec_available(codec):
+    """Check if a codec can be used."""
+    if codec == COMPRESS_ZSTD:
+        return zstandard is not None
+    if codec == COMPRESS_XZ:
+        return lzma is not None
+    return codec == COMPRESS_GZIP
+
+
+def codec_select(codec=COMPRESS_AUTO):
+    """Resolve a codec name, auto picks the best one available."""
+    if codec != COMPRESS_AUTO:
+        if not codec_available(codec):
+            raise ValueError("%s compression is not available" % codec)
+        return codec
+    for name in (COMPRESS_ZSTD, COMPRESS_XZ):
+        if codec_available(name):
+            return name
+    return COMPRESS_GZIP
+
+
+def codec_compressor(codec):
+    """Frame compression function of a codec."""
+    level = COMPRESS_LEVELS[codec]
+    if codec == COMPRESS_ZSTD:
+        compressor = zstandard.ZstdCompressor(level=level)
+        return compressor.compress
+    if codec == COMPRESS_XZ:
+        return lambda data: lzma.compress(data, preset=level)
+    return lambda data: gzip.compress(data, compresslevel=level, mtime=0)
+
+
+def codec_decompressor(codec):
+    """Frame decompression function of a codec."""
+    if not codec_available(codec):
+        raise ValueError("%s compression is not available" % codec)
+    if codec == COMPRESS_ZSTD:
+        return zstandard.ZstdDecompressor().decompress
+    if codec == COMPRESS_XZ:
+        return lzma.decompress
+    return gzip.decompress
+
+
+def is_compressed(file):
+    """Check if file is a compressed dump."""
+    try:
+        inp = open(file, "rb")
+    except OSError:
+        return False
+    magic = inp.read(len(COMPRESS_MAGIC))
+    inp.close()
+    return magic == COMPRESS_MAGIC
+
+
+class CompressedWriter:
+    """Compressed dump writer.
+
+    Pages are gathered into their block and every complete block is queued
+    as one independently compressed frame. Compressor threads append frames
+    in whatever order they finish and an index of the frame of every block
+    is written at the end, so a single page only needs its block frame to
+    be decompressed. zlib, lzma and zstd release the GIL while compressing,
+    so the threads run in parallel with the read pipeline. Blocks holding
+    pages that may still be re-read are kept back until closing. A failed
+    compressor thread keeps draining the queue and its error is raised by
+    the next store or close.
+    """
+
+    def __init__(self, file, nand, codec):
+        """Open compressed dump."""
+        self.codec = codec
+        self.raw_page_size = nand.raw_page_size
+        self.block_pages = nand.block_pages
+        self.pages = nand.pages
+        self.blocks = (nand.pages + nand.block_pages - 1) // nand.block_pages
+        self.nand = nand
+        self.out = open(file, "wb")
+        # The index offset stays 0 until the dump is closed
+        self.out.write(bytearray(self.header(0)))
+        self.offset = self.out.tell()
+        self.index = [(0, 0, 0)] * self.blocks
+        self.lock = threading.Lock()
+        self.error = None
+
+        self.pending = {}
+        self.held = set()
+        self.raw_bytes = 0
+        self.compressed_bytes = 0
+        self.compress_time = 0.0
+        self.stalls = 0
+        self.stall_time = 0.0
+        self.start = time.perf_counter()
+
+        self.jobs = queue.Queue(COMPRESS_QUEUE_BLOCKS)
+        self.threads = [
+            threading.Thread(target=self.work, daemon=True)
+            for _ in range(min(os.cpu_count() or 1, COMPRESS_THREADS))
+        ]
+        for thread in self.threads:
+            thread.start()
+
+    def header(self, index_offset):
+        """Compressed dump header."""
+        nand = self.nand
+        return CompressedHeader(
+            magic=COMPRESS_MAGIC,
+            version=COMPRESS_VERSION,
+            header_size=ctypes.sizeof(CompressedHeader),
+            codec=COMPRESS_CODECS[self.codec],
+            mf_id=nand.mf_id,
+            dev_id=nand.dev_id,
+            page_size=nand.page_size,
+            oob_size=nand.oob_size,
+            block_pages=nand.block_pages,
+            pages=nand.pages,
+            frames=self.blocks,
+            index_offset=index_offset,
+        )
+
+    def block_len(self, block):
+        """Number of pages in a block."""
+        return min(self.block_pages, self.pages - block * self.block_pages)
+
+    def check(self):
+        """Raise the error of a failed compressor thread."""
+        if self.error is not None:
+            raise OSError("Compression failed: %s" % self.error)
+
+    def store_page(self, page, data, hold=False):
+        """Store a raw page, a held block isn't compressed until closing."""
+        self.check()
+        block, index = divmod(page, self.block_pages)
+        entry = self.pending.get(block)
+        if entry is None:
+            entry = self.pending[block] = [
+                bytearray(self.block_len(block) * self.raw_page_size),
+                set(),
+            ]
+        offset = index * self.raw_page_size
+        entry[0][offset : offset + self.raw_page_size] = data
+        entry[1].add(page)
+        if hold:
+            self.held.add(page)
+        else:
+            self.held.discard(page)
+
+        if len(entry[1]) == self.block_len(block) and not any(
+            held // self.block_pages == block for held in self.held
+        ):
+            self.submit(block)
+
+    def submit(self, block, wait=False):
+        """Queue a block for compression."""
+        job = (block, self.pending.pop(block)[0])
+        if wait:
+            self.jobs.put(job)
+            return
+        try:
+            self.jobs.put_nowait(job)
+        except queue.Full:
+            # Every compressor is busy and the read has to wait
+            self.stalls += 1
+            start = time.perf_counter()
+            self.jobs.put(job)
+            self.stall_time += time.perf_counter() - start
+
+    def work(self):
+        """Compress queued blocks."""
+        compress = codec_compressor(self.codec)
+        while True:
+            job = self.jobs.get()
+            if job is None:
+                break
+            # Blocks queued after a failure are dropped
+            if self.error is not None:
+                continue
+            try:
+                self.compress_block(compress, *job)
+            except Exception as err:  # pylint: disable=broad-except
+                with self.lock:
+                    if self.error is None:
+                        self.error = err
+
+    def compress_block(self, compress, block, data):
+        """Compress a block and append its frame."""
+        start = time.perf_counter()
+        frame = compress(bytes(data))
+        crc = crc32(CRC32_START, data, len(data))
+        elapsed = time.perf_counter() - start
+        with self.lock:
+            self.out.seek(self.offset)
+            self.out.write(frame)
+            self.index[block] = (self.offset, len(frame), crc)
+            self.offset += len(frame)
+            self.raw_bytes += len(data)
+            self.compressed_bytes += len(frame)
+            self.compress_time += elapsed
+
+    def close(self, res=True):
+        """Compress held blocks and write the index.
+
+        The index of a failed read isn't written, so its index offset stays
+        0 and the dump is refused as incomplete. Raises OSError if a
+        compressor thread failed.
+        """
+        for block, (_, stored) in list(self.pending.items()):
+            # Incomplete blocks of a failed read have no frame
+            if len(stored) == self.block_len(block):
+                self.submit(block, wait=True)
+        for _ in self.threads:
+            self.jobs.put(None)
+        for thread in self.threads:
+            thread.join()
+        if not res or self.error is not None:
+            self.out.close()
+            self.check()
+            return
+
+        self.out.seek(self.offset)
+        for entry in self.index:
+            self.out.write(COMPRESS_INDEX_STRUCT.pack(*entry))
+        self.out.seek(0)
+        self.out.write(bytearray(self.header(self.offset)))
+        self.out.close()
+
+    def log_summary(self, log):
+        """Log compression ratio and whether it slowed down the read."""
+        elapsed = max(time.perf_counter() - self.start, 1e-6)
+        log.info(
+            "Compression (%s): %.2f MB -> %.2f MB, ratio %.2f, %.2f MB/s"
+            " over %d threads\n",
+            self.codec,
+            self.raw_bytes / MB,
+            self.compressed_bytes / MB,
+            self.raw_bytes / max(self.compressed_bytes, 1),
+            self.raw_bytes / max(self.compress_time, 1e-6) / MB,
+            len(self.threads),
+        )
+        if self.stalls:
+            log.warning(
+                "Compression was the bottleneck: read waited %d times,"
+                " %.2f s (%d%% of the read)\n",
+                self.stalls,
+                self.stall_time,
+                int(self.stall_time * 100 / elapsed),
+            )
+        else:
+            log.info("Compression kept up with the read\n")
+
+
+class CompressedImage:
+    """Compressed dump reader.
+
+    Only the frame of the block holding a page is decompressed, and the
+    last block is kept for sequential reads.
+    """
+
+    def __init__(self, file):
+        """Open compressed dump."""
+        self.file = file
+        self.inp = open(file, "rb")
+        self.hdr = CompressedHeader.from_buffer_copy(
+            self.inp.read(ctypes.sizeof(CompressedHeader)).ljust(
+                ctypes.sizeof(CompressedHeader), b"\0"
+            )
+        )
+        if self.hdr.magic != COMPRESS_MAGIC:
+            self.close()
+            raise ValueError("%s: not a NAND IO compressed dump" % file)
+        if self.hdr.version != COMPRESS_VERSION:
+            self.close()
+            raise ValueError("%s: unsupported compressed dump" % file)
+        if not self.hdr.index_offset:
+            self.close()
+            raise ValueError("%s: incomplete compressed dump" % file)
+
+        codecs = {codec_id: name for name, codec_id in COMPRESS_CODECS.items()}
+        self.codec = codecs.get(self.hdr.codec)
+        try:
+            self.decompress = codec_decompressor(self.codec)
+        except ValueError:
+            self.close()
+            raise
+        self.pages = self.hdr.pages
+        self.block_pages = self.hdr.block_pages
+        self.raw_page_size = self.hdr.page_size + self.hdr.oob_size
+
+        self.inp.seek(self.hdr.index_offset)
+        index = self.inp.read(self.hdr.frames * COMPRESS_INDEX_STRUCT.size)
+        self.index = list(COMPRESS_INDEX_STRUCT.iter_unpack(index))
+        self.block = None
+        self.block_data = None
+
+    def close(self):
+        """Close compressed dump."""
+        self.inp.close()
+
+    def read_block(self, block):
+        """Raw block, None if it wasn't stored."""
+        if block == self.block:
+            return self.block_data
+
+        offset, size, crc = self.index[block]
+        if not size:
+            return None
+        self.inp.seek(offset)
+        data = self.decompress(self.inp.read(size))
+        if crc32(CRC32_START, data, len(data)) != crc:
+            raise ValueError("%s: block %d CRC mismatch" % (self.file, block))
+
+        self.block = block
+        self.block_data = data
+        return data
+
+    def read_page(self, page):
+        """Raw page (data and OOB), None if not stored."""
+        block, index = divmod(page, self.block_pages)
+        data = self.read_block(block)
+        if data is None:
+            return None
+        offset = index * self.raw_page_size
+        return data[offset : offset + self.raw_page_size]
+
+
+def compressed_to_raw(file, raw_file):
+    """Convert a compressed dump into a raw dump.
+
+    Missing blocks are left 0xFF and returned, so they can be reported.
+    """
+    image = CompressedImage(file)
+    out = open(raw_file, "wb")
+    missing = []
+    for block in range(len(image.index)):
+        data = image.read_block(block)
+        if data is None:
+            missing.append(block)
+            pages = min(image.block_pages, image.pages - block * image.block_pages)
+            data = b"\xff" * (pages * image.raw_page_size)
+        out.write(data)
+    out.close()
+    image.close()
+    return missing
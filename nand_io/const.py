@@ -1,6 +1,7 @@
 # SPDX-License-Identifier: MIT
 """NAND IO constants."""
 
+NM_BAD_BLOCK_POS = "bad-block-pos"
 NM_BLOCK_SIZE = "block-size"
 NM_BLOCK_SIZE_BASE = "block-size-base"
 NM_BLOCK_SIZE_MASK = "block-size-mask"
@@ -9,7 +10,13 @@ NM_BUS_WIDTH = "bus-width"
 NM_BUS_WIDTH_BASE = "bus-size-base"
 NM_BUS_WIDTH_MASK = "bus-size-mask"
 NM_BUS_WIDTH_SHIFT = "bus-size-shift"
+NM_CACHE_PROGRAM = "cache-program"
 NM_DEVICES = "devices"
+NM_ECC_ALGO = "ecc-algo"
+NM_ECC_BYTES = "ecc-bytes"
+NM_ECC_POS = "ecc-pos"
+NM_ECC_STEP_SIZE = "ecc-step-size"
+NM_ECC_STRENGTH = "ecc-strength"
 NM_LAYOUT = "layout"
 NM_NAME = "name"
 NM_OOB_SIZE = "oob-size"
@@ -30,11 +37,42 @@ NM_PLANE_SIZE = "plane-size"
 NM_PLANE_SIZE_BASE = "plane-size-base"
 NM_PLANE_SIZE_MASK = "plane-size-mask"
 NM_PLANE_SIZE_SHIFT = "plane-size-shift"
+NM_RE_DELAY_NOPS = "re-delay-nops"
 NM_READ_DELAY_US = "read-delay-us"
 
 NAND_PAGE_ADDR_3B = 1
 NAND_PAGE_ADDR_4B = 2
 
+# RE# low time in cycles, the former fixed 0.2 us at 8 MHz
+NAND_RE_DELAY_NOPS = 2
+
+NAND_STATUS_FAIL = 0x01
+NAND_STATUS_FAILC = 0x02
+NAND_STATUS_ARDY = 0x20
+NAND_STATUS_RDY = 0x40
+
+ECC_BCH = "bch"
+ECC_HAMMING = "hamming"
+
+# Small page, software Hamming over 256 bytes (Linux nand_oob_16)
+NAND_LAYOUT_SP_HAMMING = {
+    NM_BAD_BLOCK_POS: [5],
+    NM_ECC_ALGO: ECC_HAMMING,
+    NM_ECC_BYTES: 3,
+    NM_ECC_POS: [0, 1, 2, 3, 6, 7],
+    NM_ECC_STEP_SIZE: 256,
+}
+
+# Large page, 4 bit BCH over 512 bytes at the end of a 64 byte OOB
+NAND_LAYOUT_LP_BCH4 = {
+    NM_BAD_BLOCK_POS: [0, 1],
+    NM_ECC_ALGO: ECC_BCH,
+    NM_ECC_BYTES: 7,
+    NM_ECC_POS: list(range(36, 64)),
+    NM_ECC_STEP_SIZE: 512,
+    NM_ECC_STRENGTH: 4,
+}
+
 NAND_DEVICES = {
     0xAD: {
         NM_NAME: "Hynix",
@@ -43,6 +81,7 @@ NAND_DEVICES = {
                 NM_NAME: "HY27US08281A",
                 NM_BLOCK_SIZE: 16384,
                 NM_BUS_WIDTH: 8,
+                NM_LAYOUT: NAND_LAYOUT_SP_HAMMING,
                 NM_PAGE_ADDR_TYPE: NAND_PAGE_ADDR_3B,
                 NM_OOB_SIZE: 16,
                 NM_PAGE_SIZE: 512,
@@ -63,6 +102,8 @@ NAND_DEVICES = {
                 NM_BUS_WIDTH_BASE: 8,
                 NM_BUS_WIDTH_MASK: 0x01,
                 NM_BUS_WIDTH_SHIFT: 6,
+                NM_CACHE_PROGRAM: True,
+                NM_LAYOUT: NAND_LAYOUT_LP_BCH4,
                 NM_OOB_SIZE_BASE: 8,
                 NM_OOB_SIZE_MASK: 0x01,
                 NM_OOB_SIZE_SHIFT: 2,
@@ -86,6 +127,7 @@ NAND_DEVICES = {
                 NM_NAME: "K9T1G08U0M",
                 NM_BLOCK_SIZE: 16384,
                 NM_BUS_WIDTH: 8,
+                NM_LAYOUT: NAND_LAYOUT_SP_HAMMING,
                 NM_OOB_SIZE: 16,
                 NM_PAGE_ADDR_TYPE: NAND_PAGE_ADDR_4B,
                 NM_PAGE_SIZE: 512,
@@ -97,13 +139,157 @@ NAND_DEVICES = {
     },
 }
 
+# Linux MTD on-flash bad block table, 2 bits per block
+BBT_BLOCK_GOOD = 0x03
+BBT_BLOCK_RESERVED = 0x02
+BBT_MAP_SUFFIX = ".bbt"
+BBT_MAP_VERSION = 1
+BBT_MAX_BLOCKS = 4
+BBT_PATTERN_MAIN = b"Bbt0"
+BBT_PATTERN_MIRROR = b"1tbB"
+BBT_PATTERN_OFFSET = 8
+BBT_SOURCE_BBT = "bbt"
+BBT_SOURCE_MARKERS = "markers"
+BBT_VERSION_OFFSET = 12
+
+BLANK_SUFFIX = ".blank"
+BLANK_VERSION = 1
+
+COMPRESS_AUTO = "auto"
+COMPRESS_GZIP = "gzip"
+COMPRESS_XZ = "xz"
+COMPRESS_ZSTD = "zstd"
+# Codec IDs stored in compressed dumps
+COMPRESS_CODECS = {
+    COMPRESS_GZIP: 1,
+    COMPRESS_XZ: 2,
+    COMPRESS_ZSTD: 3,
+}
+COMPRESS_LEVELS = {
+    COMPRESS_GZIP: 6,
+    COMPRESS_XZ: 3,
+    COMPRESS_ZSTD: 3,
+}
+COMPRESS_MAGIC = b"NIOZ"
+# Complete blocks waiting for a compressor thread
+COMPRESS_QUEUE_BLOCKS = 64
+COMPRESS_THREADS = 4
+COMPRESS_VERSION = 1
+
+CONTAINER_ALIGN = 4096
+CONTAINER_MAGIC = b"NIOC"
+CONTAINER_VERSION = 1
+# Container page flags
+CONTAINER_PRESENT = 0x01
+CONTAINER_BLANK = 0x02
+CONTAINER_UNSTABLE = 0x04
+
+DIFF_CHUNK_SIZE = 8 * 1024 * 1024
+# Pages with more bit flips share the last histogram bucket
+DIFF_HISTOGRAM_MAX = 16
+
+ECC_BCH_PRIM_POLY = {
+    5: 0x25,
+    6: 0x43,
+    7: 0x83,
+    8: 0x11D,
+    9: 0x211,
+    10: 0x409,
+    11: 0x805,
+    12: 0x1053,
+    13: 0x201B,
+    14: 0x402B,
+    15: 0x8003,
+}
+ECC_CHUNK_PAGES = 256
+ECC_REPORT_SUFFIX = ".ecc"
+# Uncorrectable pages re-read settings, (read delay us, votes)
+ECC_REREAD_SETTINGS = [
+    (10, 1),
+    (20, 3),
+    (50, 5),
+]
+ECC_UNCORRECTABLE = -1
+
+EMULATOR_DEF_ID = b"\xad\x73\x00\x00\x00"
+EMULATOR_DEVICE = 2
+# Bit error rate of reads with marginal timings
+EMULATOR_MARGINAL_ERROR_RATE = 0.001
+EMULATOR_STATUS_READY = 0xE0
+EMULATOR_T_ERASE_US = 2000
+EMULATOR_T_PROG_US = 200
+EMULATOR_T_READ_US = 25
+
+FILE_CACHE_PAGES = 1024
+FILE_READAHEAD_PAGES = 128
+
+JOURNAL_SUFFIX = ".journal"
+JOURNAL_SYNC_PAGES = 256
+JOURNAL_VERSION = 1
+
+METRICS_EXPORT_INTERVAL = 5.0
+METRICS_FORMAT_JSON = "json"
+METRICS_FORMAT_PROMETHEUS = "prometheus"
+# Request latency histogram bucket bounds (s)
+METRICS_LATENCY_BUCKETS = [
+    0.0001,
+    0.0002,
+    0.0005,
+    0.001,
+    0.002,
+    0.005,
+    0.01,
+    0.02,
+    0.05,
+    0.1,
+    0.2,
+    0.5,
+    1.0,
+    2.0,
+]
+METRICS_PROGRESS_INTERVAL = 0.25
+
+MULTI_MODE_EACH = "each"
+MULTI_MODE_SPLIT = "split"
+
 PAGE_RW_RETRIES = 3
 
-PROTOCOL_VERSION = 1
+PIPELINE_BUFFERS = 16
+PIPELINE_WINDOW = 2
+
+PROTOCOL_VERSION = 3
 
 SERIAL_BUFFER_SIZE = 32768
 SERIAL_DEF_SPEED = 9600
 SERIAL_DEF_TIMEOUT = 1
 SERIAL_DEVICES = {
     1: "Teensy++ 2.0",
+    EMULATOR_DEVICE: "Emulator",
+    3: "Host",
 }
+SERIAL_USB_IDS = [
+    (0x16C0, 0x0483),
+]
+
+SERVE_CACHE_PAGES = 4096
+SERVE_OP_ERASE = "erase"
+SERVE_OP_INFO = "info"
+SERVE_OP_PROGRAM = "program"
+SERVE_OP_READ = "read"
+SERVE_OP_STATS = "stats"
+SERVE_READ_MAX_PAGES = 4096
+
+STORE_DIGEST_SIZE = 16
+STORE_INDEX_SUFFIX = ".idx"
+STORE_MANIFEST_VERSION = 1
+STORE_PACK_SUFFIX = ".pack"
+STORE_PACKS_DIR = "packs"
+
+TUNE_CACHE_DIR = "nand-io"
+TUNE_CACHE_FILE = "timing.json"
+# Sample reads compared against the reference at every setting
+TUNE_PASSES = 2
+# Candidate settings, slowest first
+TUNE_RE_DELAY_NOPS = [16, 8, 4, 2, 1, 0]
+TUNE_READ_DELAYS_US = [50, 20, 10, 5, 2, 1]
+TUNE_SAMPLE_PAGES = 32
@@ -0,0 +1,244 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO indexed container."""
+
+import ctypes
+import mmap
+import struct
+
+from .const import (
+    CONTAINER_ALIGN,
+    CONTAINER_BLANK,
+    CONTAINER_MAGIC,
+    CONTAINER_PRESENT,
+    CONTAINER_VERSION,
+)
+from .crc import CRC32_START, crc32
+from .image import open_image
+
+CONTAINER_INDEX_STRUCT = struct.Struct("<II")
+
+
+class ContainerHeader(ctypes.LittleEndianStructure):
+    """Container header."""
+
+    _pack_ = 1
+    _fields_ = [
+        ("magic", ctypes.c_char * 4),
+        ("version", ctypes.c_uint16),
+        ("header_size", ctypes.c_uint16),
+        ("mf_id", ctypes.c_uint8),
+        ("dev_id", ctypes.c_uint8),
+        ("bus_width", ctypes.c_uint8),
+        ("page_addr_type", ctypes.c_uint8),
+        ("page_size", ctypes.c_uint32),
+        ("oob_size", ctypes.c_uint32),
+        ("block_size", ctypes.c_uint32),
+        ("block_pages", ctypes.c_uint32),
+        ("planes", ctypes.c_uint32),
+        ("plane_size", ctypes.c_uint64),
+        ("pages", ctypes.c_uint32),
+        ("data_offset", ctypes.c_uint64),
+        ("oob_offset", ctypes.c_uint64),
+        ("index_offset", ctypes.c_uint64),
+        ("size", ctypes.c_uint64),
+    ]
+
+
+def _align(offset):
+    """Align container stream offset."""
+    return (offset + CONTAINER_ALIGN - 1) // CONTAINER_ALIGN * CONTAINER_ALIGN
+
+
+def container_create(file, nand):
+    """Create an empty container for the NAND geometry."""
+    data_offset = _align(ctypes.sizeof(ContainerHeader))
+    oob_offset = _align(data_offset + nand.pages * nand.page_size)
+    index_offset = _align(oob_offset + nand.pages * nand.oob_size)
+    size = index_offset + nand.pages * CONTAINER_INDEX_STRUCT.size
+
+    hdr = ContainerHeader(
+        magic=CONTAINER_MAGIC,
+        version=CONTAINER_VERSION,
+        header_size=ctypes.sizeof(ContainerHeader),
+        mf_id=nand.mf_id,
+        dev_id=nand.dev_id,
+        bus_width=nand.bus_width,
+        page_addr_type=nand.page_addr_type,
+        page_size=nand.page_size,
+        oob_size=nand.oob_size,
+        block_size=nand.block_size,
+        block_pages=nand.block_pages,
+        planes=nand.planes,
+        plane_size=nand.plane_size,
+        pages=nand.pages,
+        data_offset=data_offset,
+        oob_offset=oob_offset,
+        index_offset=index_offset,
+        size=size,
+    )
+
+    out = open(file, "wb")
+    out.write(bytearray(hdr))
+    # Streams are left as holes until pages are stored
+    out.truncate(size)
+    out.close()
+
+    return Container(file, writable=True)
+
+
+def is_container(file):
+    """Check if file is a container."""
+    try:
+        inp = open(file, "rb")
+    except OSError:
+        return False
+    magic = inp.read(len(CONTAINER_MAGIC))
+    inp.close()
+    return magic == CONTAINER_MAGIC
+
+
+class Container:
+    """Indexed container.
+
+    A header with the chip ID and geometry is followed by the page data
+    stream, the OOB stream and an index holding flags and the CRC32 of every
+    raw page. Streams have fixed offsets, so the file is mapped once and any
+    page is stored or fetched in O(1) and in any order.
+    """
+
+    def __init__(self, file, writable=False):
+        """Open container."""
+        self.file = file
+        self.writable = writable
+        self.fd = open(file, "r+b" if writable else "rb")
+        access = mmap.ACCESS_WRITE if writable else mmap.ACCESS_READ
+        self.map = mmap.mmap(self.fd.fileno(), 0, access=access)
+        self.view = memoryview(self.map)
+
+        self.hdr = ContainerHeader.from_buffer_copy(self.map)
+        if self.hdr.magic != CONTAINER_MAGIC:
+            self.close()
+            raise ValueError("%s: not a NAND IO container" % file)
+        if self.hdr.version != CONTAINER_VERSION or self.hdr.size > len(self.map):
+            self.close()
+            raise ValueError("%s: unsupported container" % file)
+
+        self.mf_id = self.hdr.mf_id
+        self.dev_id = self.hdr.dev_id
+        self.page_size = self.hdr.page_size
+        self.oob_size = self.hdr.oob_size
+        self.block_pages = self.hdr.block_pages
+        self.pages = self.hdr.pages
+        self.raw_page_size = self.page_size + self.oob_size
+        self.blank = b"\xff" * self.raw_page_size
+
+    def close(self):
+        """Close container."""
+        if self.map:
+            self.view.release()
+            self.map.close()
+            self.map = None
+        self.fd.close()
+
+    def crc(self, page):
+        """Stored raw page CRC32."""
+        return self.index(page)[1]
+
+    def data(self, page):
+        """Page data view."""
+        offset = self.hdr.data_offset + page * self.page_size
+        return self.view[offset : offset + self.page_size]
+
+    def flags(self, page):
+        """Page flags."""
+        return self.index(page)[0]
+
+    def flush(self):
+        """Flush container to disk."""
+        if self.writable:
+            self.map.flush()
+
+    def index(self, page):
+        """Page index entry as (flags, crc)."""
+        return CONTAINER_INDEX_STRUCT.unpack_from(
+            self.map, self.hdr.index_offset + page * CONTAINER_INDEX_STRUCT.size
+        )
+
+    def oob(self, page):
+        """Page OOB view."""
+        offset = self.hdr.oob_offset + page * self.oob_size
+        return self.view[offset : offset + self.oob_size]
+
+    def read_page(self, page):
+        """Raw page (data and OOB), None if not stored."""
+        if not self.flags(page) & CONTAINER_PRESENT:
+            return None
+        return bytes(self.data(page)) + bytes(self.oob(page))
+
+    def verify_page(self, page):
+        """Check stored page against its CRC32."""
+        raw = self.read_page(page)
+        if raw is None:
+            return False
+        return crc32(CRC32_START, raw, len(raw)) == self.crc(page)
+
+    def write_page(self, page, raw, flags=0):
+        """Store a raw page (data and OOB)."""
+        raw = memoryview(raw)
+        offset = self.hdr.data_offset + page * self.page_size
+        self.view[offset : offset + self.page_size] = raw[: self.page_size]
+        offset = self.hdr.oob_offset + page * self.oob_size
+        self.view[offset : offset + self.oob_size] = raw[self.page_size :]
+
+        if raw.tobytes() == self.blank:
+            flags |= CONTAINER_BLANK
+        CONTAINER_INDEX_STRUCT.pack_into(
+            self.map,
+            self.hdr.index_offset + page * CONTAINER_INDEX_STRUCT.size,
+            flags | CONTAINER_PRESENT,
+            crc32(CRC32_START, raw, self.raw_page_size),
+        )
+
+
+def container_from_raw(raw_file, file, nand):
+    """Convert a raw dump into a container."""
+    container = container_create(file, nand)
+    inp = open_image(raw_file)
+    for page in range(nand.pages):
+        raw = inp.read(nand.raw_page_size)
+        if len(raw) != nand.raw_page_size:
+            break
+        container.write_page(page, raw)
+    inp.close()
+    container.close()
+
+
+def container_to_raw(file, raw_file):
+    """Convert a container into a raw dump, missing pages are left 0xFF."""
+    container = Container(file)
+    blank = b"\xff" * container.raw_page_size
+    out = open(raw_file, "wb")
+    for page in range(container.pages):
+        raw = container.read_page(page)
+        out.write(blank if raw is None else raw)
+    out.close()
+    container.close()
+
+
+class ContainerGeometry:
+    """Geometry of a raw dump converted into a container."""
+
+    def __init__(self, page_size, oob_size, block_pages, pages):
+        """Init container geometry."""
+        self.mf_id = 0
+        self.dev_id = 0
+        self.bus_width = 8
+        self.page_addr_type = 0
+        self.page_size = page_size
+        self.oob_size = oob_size
+        self.block_size = page_size * block_pages
+        self.block_pages = block_pages
+        self.planes = 1
+        self.plane_size = self.block_size * (pages // block_pages)
+        self.pages = pages
+        self.raw_page_size = page_size + oob_size
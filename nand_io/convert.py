@@ -0,0 +1,80 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO dump converters."""
+
+import argparse
+import os
+import sys
+
+from .common import add_raw_geometry_args
+from .compress import compressed_to_raw
+from .container import ContainerGeometry, container_from_raw, container_to_raw
+from .logger import INFO, Logger
+
+
+def main():
+    """NAND IO dump converters."""
+    parser = argparse.ArgumentParser(description="")
+
+    parser.add_argument(
+        "--decompress",
+        dest="decompress",
+        nargs=2,
+        metavar=("COMPRESSED", "RAW"),
+        help="Convert a compressed dump into a raw dump",
+    )
+
+    parser.add_argument(
+        "--from-raw",
+        dest="from_raw",
+        nargs=2,
+        metavar=("RAW", "CONTAINER"),
+        help="Convert a raw dump into a container",
+    )
+
+    parser.add_argument(
+        "--to-raw",
+        dest="to_raw",
+        nargs=2,
+        metavar=("CONTAINER", "RAW"),
+        help="Convert a container into a raw dump",
+    )
+
+    add_raw_geometry_args(parser, block_pages=True)
+
+    args = parser.parse_args()
+
+    if args.from_raw:
+        if not (args.page_size and args.oob_size is not None and args.block_pages):
+            parser.print_help()
+            return 2
+        raw_file, file = args.from_raw
+        raw_page_size = args.page_size + args.oob_size
+        pages = os.path.getsize(raw_file) // raw_page_size
+        geometry = ContainerGeometry(
+            args.page_size, args.oob_size, args.block_pages, pages
+        )
+        container_from_raw(raw_file, file, geometry)
+    elif args.to_raw:
+        container_to_raw(*args.to_raw)
+    elif args.decompress:
+        log = Logger(level=INFO, stream=sys.stdout)
+        try:
+            missing = compressed_to_raw(*args.decompress)
+        except ValueError as err:
+            log.error("%s\n", err)
+            return 1
+        if missing:
+            log.warning(
+                "%d blocks missing from %s, left 0xFF: %s\n",
+                len(missing),
+                args.decompress[0],
+                ", ".join(str(block) for block in missing),
+            )
+            return 1
+    else:
+        parser.print_help()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,128 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO offline ECC correction."""
+
+import argparse
+import sys
+
+from .common import add_nand_id_arg, add_raw_geometry_args, auto_int
+from .const import ECC_REPORT_SUFFIX
+from .container import Container, is_container
+from .ecc import EccEngine, EccStats, correct_image, default_layout, device_layout
+from .image import open_image
+from .logger import ERROR, INFO, Logger
+from .nand import Nand
+from .protocol import IONandIdRX
+
+
+class ContainerStream:
+    """Raw page stream of a container, missing pages are 0xFF."""
+
+    def __init__(self, container):
+        """Init container stream."""
+        self.container = container
+        self.page = 0
+
+    def read(self, size):
+        """Read whole raw pages."""
+        data = bytearray()
+        blank = self.container.blank
+        while len(data) < size and self.page < self.container.pages:
+            raw = self.container.read_page(self.page)
+            data += blank if raw is None else raw
+            self.page += 1
+        return bytes(data)
+
+
+def main():
+    """NAND IO offline ECC correction."""
+    parser = argparse.ArgumentParser(description="")
+
+    parser.add_argument(
+        "input",
+        metavar="INPUT",
+        help="Raw dump, sparse dump or container",
+    )
+
+    parser.add_argument(
+        "output",
+        metavar="OUTPUT",
+        help="Corrected raw dump",
+    )
+
+    parser.add_argument(
+        "--ecc-strength",
+        dest="ecc_strength",
+        action="store",
+        type=auto_int,
+        help="BCH correctable bits per 512 bytes, ECC at the end of the OOB",
+    )
+
+    add_nand_id_arg(parser)
+
+    parser.add_argument(
+        "--jobs",
+        dest="jobs",
+        action="store",
+        type=auto_int,
+        help="Worker processes (default: CPU count)",
+    )
+
+    add_raw_geometry_args(parser)
+
+    parser.add_argument(
+        "--report",
+        dest="report",
+        action="store",
+        type=str,
+        help="Bit flips report (default: OUTPUT%s)" % ECC_REPORT_SUFFIX,
+    )
+
+    args = parser.parse_args()
+    log = Logger(level=INFO, stream=sys.stdout)
+
+    layout = None
+    container = None
+    if is_container(args.input):
+        container = Container(args.input)
+        page_size = container.page_size
+        oob_size = container.oob_size
+        layout = device_layout(container.mf_id, container.dev_id)
+    elif args.nand_id:
+        nand = Nand(Logger(level=ERROR))
+        if not nand.identify(IONandIdRX.from_buffer_copy(args.nand_id.ljust(5, b"\0"))):
+            log.error("Unknown NAND ID %s\n", args.nand_id.hex())
+            return
+        page_size = nand.page_size
+        oob_size = nand.oob_size
+        layout = nand.layout
+    elif args.page_size and args.oob_size:
+        page_size = args.page_size
+        oob_size = args.oob_size
+    else:
+        parser.print_help()
+        return
+
+    if args.ecc_strength or layout is None:
+        layout = default_layout(page_size, oob_size, args.ecc_strength)
+    engine = EccEngine(layout, page_size, oob_size)
+    log.info("ECC correction: %s\n", engine.describe())
+
+    stats = EccStats()
+    stats.open_report(args.report or args.output + ECC_REPORT_SUFFIX)
+    if container:
+        inp = ContainerStream(container)
+    else:
+        inp = open_image(args.input)
+    out = open(args.output, "wb")
+    correct_image(inp, out, engine, stats, args.jobs)
+    out.close()
+    if container:
+        container.close()
+    else:
+        inp.close()
+    stats.close()
+    stats.log_summary(log)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,7 +1,13 @@
 # SPDX-License-Identifier: MIT
 """CRC."""
 
+import array
+import random
+import sys
+import zlib
+
 CRC16_START = 0xA281
+CRC16_WORD_MIN = 64
 CRC16_TABLE = [
     0x0000,
     0xC0C1,
@@ -522,19 +528,73 @@ CRC32_TABLE = [
 ]
 
 
+CRC16_WORD_TABLE = array.array("H")
+
+
+def _crc16_word_table():
+    """Build the table for updating CRC16 with a 16 bit word at a time."""
+    if not CRC16_WORD_TABLE:
+        for word in range(0x10000):
+            crc = (word >> 8) ^ CRC16_TABLE[word & 0xFF]
+            crc = (crc >> 8) ^ CRC16_TABLE[crc & 0xFF]
+            CRC16_WORD_TABLE.append(crc)
+    return CRC16_WORD_TABLE
+
+
+def _crc_view(_bytes, _len):
+    """Limit data to _len bytes without copying."""
+    if _len == len(_bytes):
+        return _bytes
+    return memoryview(_bytes)[:_len]
+
+
 def crc16(crc, _bytes, _len):
     """CRC16 checksum."""
-    i = 0
-    while i < _len:
-        crc = (crc >> 8) ^ CRC16_TABLE[(crc ^ _bytes[i]) & 0xFF]
-        i += 1
+    data = _crc_view(_bytes, _len)
+    if _len < CRC16_WORD_MIN:
+        return crc16_table(crc, data, _len)
+
+    # The word table consumes the whole 16 bit register per step
+    table = _crc16_word_table()
+    words = array.array("H")
+    words.frombytes(data[: _len & ~1])
+    if sys.byteorder == "big":
+        words.byteswap()
+    for word in words:
+        crc = table[crc ^ word]
+    if _len & 1:
+        crc = (crc >> 8) ^ CRC16_TABLE[(crc ^ data[_len - 1]) & 0xFF]
+    return crc
+
+
+def crc16_table(crc, _bytes, _len):
+    """CRC16 checksum (table reference)."""
+    for byte in _crc_view(_bytes, _len):
+        crc = (crc >> 8) ^ CRC16_TABLE[(crc ^ byte) & 0xFF]
     return crc
 
 
 def crc32(crc, _bytes, _len):
     """CRC32 checksum."""
-    i = 0
-    while i < _len:
-        crc = (crc >> 8) ^ CRC32_TABLE[(crc ^ _bytes[i]) & 0xFF]
-        i += 1
+    # zlib applies the initial and final XOR that this CRC32 doesn't use
+    return zlib.crc32(_crc_view(_bytes, _len), crc ^ 0xFFFFFFFF) ^ 0xFFFFFFFF
+
+
+def crc32_table(crc, _bytes, _len):
+    """CRC32 checksum (table reference)."""
+    for byte in _crc_view(_bytes, _len):
+        crc = (crc >> 8) ^ CRC32_TABLE[(crc ^ byte) & 0xFF]
     return crc
+
+
+def crc_self_check(samples=64, max_len=4096):
+    """Check fast CRC implementations against the table references."""
+    rand = random.Random(0)
+    for _ in range(samples):
+        _len = rand.randrange(max_len)
+        data = bytes(rand.getrandbits(8) for _ in range(_len))
+        if crc16(CRC16_START, data, _len) != crc16_table(CRC16_START, data, _len):
+            return False
+        if crc32(CRC32_START, data, _len) != crc32_table(CRC32_START, data, _len):
+            return False
+    return True
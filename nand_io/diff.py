@@ -0,0 +1,256 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO dump comparison."""
+
+import argparse
+import collections
+import json
+import sys
+
+from .common import add_nand_id_arg, add_raw_geometry_args
+from .const import DIFF_CHUNK_SIZE, DIFF_HISTOGRAM_MAX
+from .container import Container, is_container
+from .correct import ContainerStream
+from .ecc import popcount
+from .image import open_image
+from .logger import ERROR, INFO, Logger
+from .nand import Nand
+from .protocol import IONandIdRX
+
+
+def page_flips(page_a, page_b):
+    """Bit flips between two pages."""
+    value_a = int.from_bytes(page_a, "little")
+    value_b = int.from_bytes(page_b, "little")
+    return popcount(value_a ^ value_b)
+
+
+class DumpReader:
+    """Raw pages of a raw dump, sparse dump or container in chunks."""
+
+    def __init__(self, file, chunk_size):
+        """Open dump."""
+        self.container = None
+        if is_container(file):
+            self.container = Container(file)
+            self.inp = ContainerStream(self.container)
+        else:
+            self.inp = open_image(file)
+        # Plain files are read into one reused buffer
+        self.buffer = None
+        if hasattr(self.inp, "readinto"):
+            self.buffer = bytearray(chunk_size)
+            self.view = memoryview(self.buffer)
+
+    def close(self):
+        """Close dump."""
+        if self.buffer is not None:
+            self.view.release()
+        if self.container:
+            self.container.close()
+        else:
+            self.inp.close()
+
+    def read(self, size):
+        """Read up to size bytes."""
+        if self.buffer is None:
+            return self.inp.read(size)
+        done = 0
+        while done < size:
+            length = self.inp.readinto(self.view[done:size])
+            if not length:
+                break
+            done += length
+        # Comparing bytearrays is a memcmp, unlike memoryviews
+        if done == len(self.buffer):
+            return self.buffer
+        return self.buffer[:done]
+
+
+class DumpDiff:
+    """Dump comparison.
+
+    Both dumps are read in large chunks and only chunks that differ are
+    compared page by page, so identical areas run at memcmp speed. Bit
+    flips of differing pages are counted separately for data and OOB.
+    """
+
+    def __init__(self, page_size, oob_size, block_pages):
+        """Init dump comparison."""
+        self.page_size = page_size
+        self.raw_page_size = page_size + oob_size
+        self.block_pages = block_pages
+        # Whole pages, so a chunk fills the reader buffer
+        self.chunk_size = (
+            max(DIFF_CHUNK_SIZE // self.raw_page_size, 1) * self.raw_page_size
+        )
+        self.pages = 0
+        self.sizes_differ = False
+        self.differing = []
+        self.data_flips = 0
+        self.oob_flips = 0
+        self.histogram = collections.Counter()
+
+    def blocks(self):
+        """Blocks holding differing pages."""
+        return sorted({page // self.block_pages for page, _, _ in self.differing})
+
+    def compare(self, reader_a, reader_b):
+        """Compare two dumps."""
+        raw_page_size = self.raw_page_size
+        chunk_size = self.chunk_size
+        page = 0
+        while True:
+            chunk_a = reader_a.read(chunk_size)
+            chunk_b = reader_b.read(chunk_size)
+            if len(chunk_a) != len(chunk_b):
+                self.sizes_differ = True
+                length = min(len(chunk_a), len(chunk_b))
+                chunk_a = chunk_a[:length]
+                chunk_b = chunk_b[:length]
+            length = len(chunk_a) // raw_page_size * raw_page_size
+            if not length:
+                break
+            if chunk_a != chunk_b:
+                self.compare_pages(page, chunk_a, chunk_b, length)
+            page += length // raw_page_size
+            if length < chunk_size:
+                break
+        self.pages = page
+
+    def compare_pages(self, first, chunk_a, chunk_b, length):
+        """Compare the pages of a differing chunk."""
+        raw_page_size = self.raw_page_size
+        page_size = self.page_size
+        for offset in range(0, length, raw_page_size):
+            page_a = chunk_a[offset : offset + raw_page_size]
+            page_b = chunk_b[offset : offset + raw_page_size]
+            if page_a == page_b:
+                continue
+            data = page_flips(page_a[:page_size], page_b[:page_size])
+            oob = page_flips(page_a[page_size:], page_b[page_size:])
+            self.differing.append((first + offset // raw_page_size, data, oob))
+            self.data_flips += data
+            self.oob_flips += oob
+            self.histogram[min(data + oob, DIFF_HISTOGRAM_MAX)] += 1
+
+    def log_summary(self, log, pages=False):
+        """Log differing pages and blocks with a bit flip histogram."""
+        if not self.differing:
+            log.info("Identical: %d pages\n", self.pages)
+            return
+
+        blocks = self.blocks()
+        log.info("Differing pages: %d of %d\n", len(self.differing), self.pages)
+        log.info(
+            "Differing blocks: %d of %d\n",
+            len(blocks),
+            (self.pages + self.block_pages - 1) // self.block_pages,
+        )
+        log.info("Bit flips: %d data, %d OOB\n", self.data_flips, self.oob_flips)
+        log.info("Bit flips per page:\n")
+        for flips in sorted(self.histogram):
+            log.info(
+                "\t%s%d: %d pages\n",
+                ">=" if flips == DIFF_HISTOGRAM_MAX else "",
+                flips,
+                self.histogram[flips],
+            )
+        if pages:
+            for page, data, oob in self.differing:
+                log.info(
+                    "\tPage %d (block %d): %d data, %d OOB bit flips\n",
+                    page,
+                    page // self.block_pages,
+                    data,
+                    oob,
+                )
+
+    def write_report(self, file):
+        """Write differing pages as JSON lines."""
+        with open(file, "w", encoding="utf-8") as report:
+            for page, data, oob in self.differing:
+                entry = {
+                    "page": page,
+                    "block": page // self.block_pages,
+                    "data": data,
+                    "oob": oob,
+                }
+                report.write(json.dumps(entry) + "\n")
+
+
+def main():
+    """NAND IO dump comparison."""
+    parser = argparse.ArgumentParser(description="")
+
+    parser.add_argument(
+        "input_a",
+        metavar="A",
+        help="Raw dump, sparse dump or container (e.g. golden)",
+    )
+
+    parser.add_argument(
+        "input_b",
+        metavar="B",
+        help="Raw dump, sparse dump or container",
+    )
+
+    add_nand_id_arg(parser)
+
+    add_raw_geometry_args(parser, block_pages=True)
+
+    parser.add_argument(
+        "--pages",
+        dest="pages",
+        action="store_true",
+        help="List every differing page",
+    )
+
+    parser.add_argument(
+        "--report",
+        dest="report",
+        metavar="FILE",
+        action="store",
+        type=str,
+        help="Differing pages as JSON lines",
+    )
+
+    args = parser.parse_args()
+    log = Logger(level=INFO, stream=sys.stdout)
+
+    geometry = None
+    for file in (args.input_a, args.input_b):
+        if is_container(file):
+            container = Container(file)
+            geometry = (container.page_size, container.oob_size, container.block_pages)
+            container.close()
+            break
+    if geometry is None and args.nand_id:
+        nand = Nand(Logger(level=ERROR))
+        if not nand.identify(IONandIdRX.from_buffer_copy(args.nand_id.ljust(5, b"\0"))):
+            log.error("Unknown NAND ID %s\n", args.nand_id.hex())
+            return 2
+        geometry = (nand.page_size, nand.oob_size, nand.block_pages)
+    if geometry is None and args.page_size and args.oob_size is not None:
+        geometry = (args.page_size, args.oob_size, args.block_pages or 1)
+    if geometry is None:
+        parser.print_help()
+        return 2
+
+    diff = DumpDiff(*geometry)
+    reader_a = DumpReader(args.input_a, diff.chunk_size)
+    reader_b = DumpReader(args.input_b, diff.chunk_size)
+    diff.compare(reader_a, reader_b)
+    reader_a.close()
+    reader_b.close()
+
+    if diff.sizes_differ:
+        log.warning("Dump sizes differ, compared the first %d pages\n", diff.pages)
+    diff.log_summary(log, pages=args.pages)
+    if args.report:
+        diff.write_report(args.report)
+
+    return 1 if diff.differing or diff.sizes_differ else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
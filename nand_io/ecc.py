@@ -0,0 +1,592 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO ECC engine."""
+
+import array
+import collections
+import concurrent.futures
+import json
+import operator
+import os
+import sys
+import threading
+
+from .const import (
+    ECC_BCH,
+    ECC_BCH_PRIM_POLY,
+    ECC_CHUNK_PAGES,
+    ECC_HAMMING,
+    ECC_UNCORRECTABLE,
+    NAND_DEVICES,
+    NAND_LAYOUT_SP_HAMMING,
+    NM_DEVICES,
+    NM_ECC_ALGO,
+    NM_ECC_BYTES,
+    NM_ECC_POS,
+    NM_ECC_STEP_SIZE,
+    NM_ECC_STRENGTH,
+    NM_LAYOUT,
+)
+
+PARITY_TABLE = bytes(bin(value).count("1") & 1 for value in range(256))
+
+
+def _addressbits(value):
+    """Address bits held in the odd bits of a Hamming ECC difference."""
+    return (
+        ((value >> 1) & 1)
+        | ((value >> 2) & 2)
+        | ((value >> 3) & 4)
+        | ((value >> 4) & 8)
+    )
+
+
+def popcount(value):
+    """Number of bits set in an integer."""
+    return bin(value).count("1")
+
+
+if hasattr(int, "bit_count"):
+    popcount = int.bit_count  # noqa: F811
+
+
+def _parity(value):
+    """Parity of an integer."""
+    return popcount(value) & 1
+
+
+class Hamming:
+    """Software Hamming code over 256 bytes, Linux nand_ecc compatible.
+
+    Line parities are computed for all bytes at once from a per byte parity
+    stream held in a single integer, and column parities from the XOR of the
+    whole step folded down to a byte.
+    """
+
+    def __init__(self, step_size):
+        """Init Hamming code."""
+        if step_size != 256:
+            raise ValueError("Hamming ECC step must be 256 bytes")
+        self.step_size = step_size
+        self.ecc_bytes = 3
+        self.masks = [
+            int.from_bytes(
+                bytes((index >> bit) & 1 for index in range(step_size)), "little"
+            )
+            for bit in range(8)
+        ]
+
+    def calculate(self, data):
+        """Calculate ECC bytes."""
+        data = bytes(data)
+        line = int.from_bytes(data.translate(PARITY_TABLE), "little")
+        total = _parity(line)
+
+        code = 0
+        for bit, mask in enumerate(self.masks):
+            odd = _parity(line & mask)
+            code |= (total ^ odd) << (bit * 2)
+            code |= odd << (bit * 2 + 1)
+
+        column = int.from_bytes(data, "little")
+        width = self.step_size * 8
+        while width > 8:
+            width //= 2
+            column = (column >> width) ^ (column & ((1 << width) - 1))
+        col = (
+            _parity(column & 0xF0) << 7
+            | _parity(column & 0x0F) << 6
+            | _parity(column & 0xCC) << 5
+            | _parity(column & 0x33) << 4
+            | _parity(column & 0xAA) << 3
+            | _parity(column & 0x55) << 2
+        )
+
+        # Inverted parities, an erased step has an erased ECC
+        return bytes((~code & 0xFF, ~code >> 8 & 0xFF, ~col & 0xFF))
+
+    def correct(self, data, ecc):
+        """Correct a step in place, returns bit flips or ECC_UNCORRECTABLE.
+
+        ECC is a writable view of the stored ECC bytes.
+        """
+        calc = self.calculate(data)
+        b0 = ecc[0] ^ calc[0]
+        b1 = ecc[1] ^ calc[1]
+        b2 = ecc[2] ^ calc[2]
+        if (b0 | b1 | b2) == 0:
+            return 0
+
+        if (
+            ((b0 ^ (b0 >> 1)) & 0x55) == 0x55
+            and ((b1 ^ (b1 >> 1)) & 0x55) == 0x55
+            and ((b2 ^ (b2 >> 1)) & 0x54) == 0x54
+        ):
+            byte_addr = (_addressbits(b1) << 4) + _addressbits(b0)
+            bit_addr = _addressbits(b2 >> 2)
+            data[byte_addr] ^= 1 << bit_addr
+            return 1
+
+        if popcount(b0) + popcount(b1) + popcount(b2) == 1:
+            # Bit flip in the ECC itself
+            ecc[:] = calc
+            return 1
+
+        return ECC_UNCORRECTABLE
+
+
+def bch_order(step_size, strength):
+    """Galois field order of a BCH code."""
+    m = 5
+    while (1 << m) - 1 < step_size * 8 + m * strength:
+        m += 1
+    if m not in ECC_BCH_PRIM_POLY:
+        raise ValueError("Unsupported BCH step size %d" % step_size)
+    return m
+
+
+class Bch:
+    """Binary BCH code, Linux soft BCH conventions.
+
+    Data bits are taken MSB first, the remainder is stored MSB first and
+    XORed with the inverted ECC of an erased step, so erased pages read back
+    as valid codewords. Encoding is table driven 16 bits at a time, the
+    decoder (Berlekamp-Massey and Chien search) only runs for steps whose
+    remainder does not match.
+    """
+
+    def __init__(self, step_size, strength):
+        """Init BCH code."""
+        self.step_size = step_size
+        self.strength = strength
+
+        data_bits = step_size * 8
+        m = bch_order(step_size, strength)
+        self.m = m
+        self.n = (1 << m) - 1
+
+        self.exp = [0] * (self.n * 2)
+        self.log = [0] * (self.n + 1)
+        value = 1
+        for power in range(self.n):
+            self.exp[power] = value
+            self.log[value] = power
+            value <<= 1
+            if value & (1 << m):
+                value ^= ECC_BCH_PRIM_POLY[m]
+        self.exp[self.n :] = self.exp[: self.n]
+
+        self.poly = self.generator()
+        self.ecc_bits = self.poly.bit_length() - 1
+        self.ecc_bytes = (m * strength + 7) // 8
+        self.pad = self.ecc_bytes * 8 - self.ecc_bits
+        self.code_bits = data_bits + self.ecc_bits
+        self.mask = (1 << self.ecc_bits) - 1
+
+        # Powers of alpha repeated, so the Chien search slices them backwards
+        repeat = (strength * self.code_bits) // self.n + 2
+        self.exp_repeat = self.exp[: self.n] * repeat
+
+        table = [self.remainder_bits(value, 8) for value in range(256)]
+        self.table = [0] * 65536
+        shift = self.ecc_bits - 8
+        for high in range(256):
+            rem = table[high]
+            for low in range(256):
+                self.table[high << 8 | low] = ((rem << 8) & self.mask) ^ table[
+                    ((rem >> shift) ^ low) & 0xFF
+                ]
+
+        # Inverted ECC of an erased step
+        erased = self.encode(b"\xff" * step_size) << self.pad
+        self.erased_mask = erased ^ ((1 << (self.ecc_bytes * 8)) - 1)
+
+    def gf_mul(self, a, b):
+        """Multiply in GF(2^m)."""
+        if a == 0 or b == 0:
+            return 0
+        return self.exp[self.log[a] + self.log[b]]
+
+    def generator(self):
+        """Generator polynomial, product of the minimal polynomials."""
+        poly = 1
+        done = set()
+        for power in range(1, 2 * self.strength + 1):
+            if power in done:
+                continue
+            coset = set()
+            conj = power
+            while conj not in coset:
+                coset.add(conj)
+                conj = conj * 2 % self.n
+            done |= coset
+
+            minimal = [1]
+            for conj in coset:
+                root = self.exp[conj]
+                product = [0] * (len(minimal) + 1)
+                for degree, coef in enumerate(minimal):
+                    product[degree + 1] ^= coef
+                    product[degree] ^= self.gf_mul(coef, root)
+                minimal = product
+
+            bits = sum(coef << degree for degree, coef in enumerate(minimal))
+            result = 0
+            while bits:
+                low = bits & -bits
+                result ^= poly * low
+                bits ^= low
+            poly = result
+        return poly
+
+    def remainder_bits(self, value, bits):
+        """Remainder of value * x^ecc_bits, value being bits long."""
+        rem = value << self.ecc_bits
+        for bit in range(bits + self.ecc_bits - 1, self.ecc_bits - 1, -1):
+            if rem & (1 << bit):
+                rem ^= self.poly << (bit - self.ecc_bits)
+        return rem
+
+    def encode(self, data):
+        """BCH remainder of a step."""
+        words = array.array("H", bytes(data))
+        if sys.byteorder == "little":
+            words.byteswap()
+        rem = 0
+        shift = self.ecc_bits - 16
+        mask = self.mask
+        table = self.table
+        for word in words:
+            rem = ((rem << 16) & mask) ^ table[((rem >> shift) ^ word) & 0xFFFF]
+        return rem
+
+    def calculate(self, data):
+        """Calculate ECC bytes."""
+        code = (self.encode(data) << self.pad) ^ self.erased_mask
+        return code.to_bytes(self.ecc_bytes, "big")
+
+    def correct(self, data, ecc):
+        """Correct a step in place, returns bit flips or ECC_UNCORRECTABLE.
+
+        ECC is a writable view of the stored ECC bytes.
+        """
+        code = (self.encode(data) << self.pad) ^ self.erased_mask
+        diff = (code ^ int.from_bytes(ecc, "big")) >> self.pad
+        if diff == 0:
+            return 0
+
+        locator = self.locator(self.syndromes(diff))
+        if locator is None:
+            return ECC_UNCORRECTABLE
+        errors = self.chien(locator)
+        if errors is None:
+            return ECC_UNCORRECTABLE
+
+        for degree in errors:
+            if degree >= self.ecc_bits:
+                pos = self.code_bits - 1 - degree
+                data[pos // 8] ^= 0x80 >> (pos % 8)
+            else:
+                pos = self.ecc_bits - 1 - degree
+                ecc[pos // 8] ^= 0x80 >> (pos % 8)
+        return len(errors)
+
+    def syndromes(self, diff):
+        """Syndromes of the remainder difference."""
+        degrees = []
+        degree = 0
+        while diff:
+            if diff & 1:
+                degrees.append(degree)
+            diff >>= 1
+            degree += 1
+
+        syn = [0] * (2 * self.strength)
+        for index in range(0, 2 * self.strength, 2):
+            power = index + 1
+            value = 0
+            for degree in degrees:
+                value ^= self.exp[degree * power % self.n]
+            syn[index] = value
+        for index in range(1, 2 * self.strength, 2):
+            half = syn[index // 2]
+            syn[index] = self.gf_mul(half, half)
+        return syn
+
+    def locator(self, syn):
+        """Error locator polynomial (Berlekamp-Massey)."""
+        locator = [1] + [0] * (2 * self.strength)
+        prev = list(locator)
+        length = 0
+        gap = 1
+        prev_disc = 1
+        for index, value in enumerate(syn):
+            disc = value
+            for degree in range(1, length + 1):
+                disc ^= self.gf_mul(locator[degree], syn[index - degree])
+            if disc == 0:
+                gap += 1
+                continue
+
+            coef = self.exp[self.log[disc] - self.log[prev_disc] + self.n]
+            update = list(locator)
+            for degree, term in enumerate(prev):
+                if term and degree + gap < len(locator):
+                    update[degree + gap] ^= self.gf_mul(coef, term)
+            if 2 * length <= index:
+                prev = locator
+                length = index + 1 - length
+                prev_disc = disc
+                gap = 1
+            else:
+                gap += 1
+            locator = update
+
+        if length > self.strength:
+            return None
+        return locator[: length + 1]
+
+    def chien(self, locator):
+        """Error degrees from the locator roots, None if they don't match.
+
+        Every locator term is evaluated over all code bits at once as a
+        backwards slice of the repeated powers of alpha.
+        """
+        count = self.code_bits
+        if len(locator) == 2:
+            # Single error, 1 + s1 * alpha^-degree = 0
+            degree = self.log[locator[1]]
+            return [degree] if degree < count else None
+
+        base = len(self.exp_repeat) - self.n
+        values = [1] * count
+        for power, coef in enumerate(locator):
+            if not power or not coef:
+                continue
+            # Error at x^degree is a root at alpha^-degree
+            start = base + self.log[coef]
+            terms = self.exp_repeat[start : start - power * count : -power]
+            values = list(map(operator.xor, values, terms))
+
+        errors = []
+        degree = -1
+        while len(errors) < len(locator) - 1:
+            try:
+                degree = values.index(0, degree + 1)
+            except ValueError:
+                return None
+            errors.append(degree)
+        return errors
+
+
+def device_layout(mf_id, dev_id):
+    """OOB layout of a known NAND device."""
+    nand_dev = NAND_DEVICES.get(mf_id, {}).get(NM_DEVICES, {}).get(dev_id, {})
+    return nand_dev.get(NM_LAYOUT)
+
+
+def default_layout(page_size, oob_size, strength=None):
+    """OOB layout for a page geometry."""
+    if page_size == 512 and oob_size == 16 and not strength:
+        return NAND_LAYOUT_SP_HAMMING
+    return bch_layout(page_size, oob_size, strength or 4)
+
+
+def bch_layout(page_size, oob_size, strength):
+    """BCH layout with the ECC at the end of the OOB."""
+    ecc_bytes = (bch_order(512, strength) * strength + 7) // 8
+    total = page_size // 512 * ecc_bytes
+    if total > oob_size:
+        raise ValueError(
+            "BCH-%d ECC doesn't fit in %d OOB bytes" % (strength, oob_size)
+        )
+    return {
+        NM_ECC_ALGO: ECC_BCH,
+        NM_ECC_BYTES: ecc_bytes,
+        NM_ECC_POS: list(range(oob_size - total, oob_size)),
+        NM_ECC_STEP_SIZE: 512,
+        NM_ECC_STRENGTH: strength,
+    }
+
+
+class EccEngine:
+    """Page ECC engine for an OOB layout."""
+
+    def __init__(self, layout, page_size, oob_size):
+        """Init ECC engine."""
+        self.layout = layout
+        self.page_size = page_size
+        self.oob_size = oob_size
+        self.raw_page_size = page_size + oob_size
+        self.blank = b"\xff" * self.raw_page_size
+
+        step_size = layout[NM_ECC_STEP_SIZE]
+        if layout[NM_ECC_ALGO] == ECC_HAMMING:
+            self.code = Hamming(step_size)
+        else:
+            self.code = Bch(step_size, layout[NM_ECC_STRENGTH])
+        if self.code.ecc_bytes != layout[NM_ECC_BYTES]:
+            raise ValueError("ECC layout doesn't match the ECC size")
+
+        self.steps = []
+        ecc_bytes = layout[NM_ECC_BYTES]
+        for step in range(page_size // step_size):
+            pos = layout[NM_ECC_POS][step * ecc_bytes : (step + 1) * ecc_bytes]
+            if len(pos) != ecc_bytes:
+                raise ValueError("ECC layout doesn't cover the page")
+            self.steps.append((step * step_size, [page_size + p for p in pos]))
+        self.step_size = step_size
+
+    def describe(self):
+        """Short layout description."""
+        if self.layout[NM_ECC_ALGO] == ECC_HAMMING:
+            return "Hamming/%d" % self.step_size
+        return "BCH-%d/%d" % (self.code.strength, self.step_size)
+
+    def calculate(self, raw):
+        """Store the ECC of a raw page in its OOB."""
+        for offset, pos in self.steps:
+            ecc = self.code.calculate(raw[offset : offset + self.step_size])
+            for index, p in enumerate(pos):
+                raw[p] = ecc[index]
+
+    def correct(self, raw):
+        """Correct a raw page in place, returns bit flips or ECC_UNCORRECTABLE."""
+        if bytes(raw) == self.blank:
+            return 0
+
+        flips = 0
+        view = memoryview(raw)
+        for offset, pos in self.steps:
+            ecc = bytearray(raw[p] for p in pos)
+            res = self.code.correct(view[offset : offset + self.step_size], ecc)
+            if res == ECC_UNCORRECTABLE:
+                return ECC_UNCORRECTABLE
+            if res:
+                for index, p in enumerate(pos):
+                    raw[p] = ecc[index]
+                flips += res
+        return flips
+
+
+class EccStats:
+    """Bit flip statistics of corrected pages."""
+
+    def __init__(self):
+        """Init ECC statistics."""
+        self.lock = threading.Lock()
+        self.pages = 0
+        self.corrected = 0
+        self.flips = 0
+        self.uncorrectable = []
+        self.recovered = []
+        self.histogram = collections.Counter()
+        self.report = None
+
+    def open_report(self, file, append=False):
+        """Write per page bit flips to a JSON lines report."""
+        self.report = open(file, "a" if append else "w", encoding="utf-8")
+
+    def add(self, page, flips):
+        """Account a corrected page.
+
+        Returns False for a re-read of an uncorrectable page that is still
+        uncorrectable.
+        """
+        with self.lock:
+            entry = {"page": page, "flips": flips}
+            if page in self.uncorrectable:
+                if flips == ECC_UNCORRECTABLE:
+                    return False
+                self.uncorrectable.remove(page)
+                self.recovered.append(page)
+                entry["recovered"] = True
+            else:
+                self.pages += 1
+                if flips == 0:
+                    return True
+
+            if flips == ECC_UNCORRECTABLE:
+                self.uncorrectable.append(page)
+            elif flips:
+                self.corrected += 1
+                self.flips += flips
+                self.histogram[flips] += 1
+            if self.report:
+                self.report.write(json.dumps(entry) + "\n")
+            return True
+
+    def close(self):
+        """Close the report."""
+        if self.report:
+            self.report.close()
+            self.report = None
+
+    def sync(self):
+        """Flush the report."""
+        if self.report:
+            self.report.flush()
+
+    def log_summary(self, log):
+        """Log ECC statistics."""
+        log.info(
+            "ECC: %d pages, %d corrected (%d bit flips), %d uncorrectable\n",
+            self.pages,
+            self.corrected,
+            self.flips,
+            len(self.uncorrectable),
+        )
+        for flips in sorted(self.histogram):
+            log.info("\t%d bit flips: %d pages\n", flips, self.histogram[flips])
+        if self.recovered:
+            log.info("\tRecovered by re-reading: %d pages\n", len(self.recovered))
+        if self.uncorrectable:
+            log.warning(
+                "Uncorrectable pages: %s\n",
+                " ".join(str(page) for page in self.uncorrectable[:32]),
+            )
+
+
+WORKER_ENGINE = None
+
+
+def _worker_init(layout, page_size, oob_size):
+    """Create the ECC engine of a worker process."""
+    global WORKER_ENGINE  # pylint: disable=global-statement
+    WORKER_ENGINE = EccEngine(layout, page_size, oob_size)
+
+
+def _worker_correct(chunk):
+    """Correct a chunk of raw pages."""
+    data = bytearray(chunk)
+    raw_page_size = WORKER_ENGINE.raw_page_size
+    flips = []
+    for offset in range(0, len(data) - raw_page_size + 1, raw_page_size):
+        page = memoryview(data)[offset : offset + raw_page_size]
+        flips.append(WORKER_ENGINE.correct(page))
+    return data, flips
+
+
+def correct_image(inp, out, engine, stats, jobs=None):
+    """Correct a raw image stream with a pool of worker processes."""
+    chunk_size = engine.raw_page_size * ECC_CHUNK_PAGES
+    jobs = jobs or os.cpu_count() or 1
+    page = 0
+    pending = collections.deque()
+    with concurrent.futures.ProcessPoolExecutor(
+        jobs,
+        initializer=_worker_init,
+        initargs=(engine.layout, engine.page_size, engine.oob_size),
+    ) as executor:
+        while True:
+            chunk = inp.read(chunk_size)
+            if chunk:
+                pending.append(executor.submit(_worker_correct, chunk))
+            if pending and (not chunk or len(pending) >= jobs * 2):
+                data, flips = pending.popleft().result()
+                out.write(data)
+                for res in flips:
+                    stats.add(page, res)
+                    page += 1
+            elif not chunk:
+                break
+    return page
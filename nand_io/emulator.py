@@ -0,0 +1,697 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO device emulator."""
+
+import argparse
+import collections
+import ctypes
+import mmap
+import os
+import random
+import select
+import threading
+import time
+import tty
+
+from .const import (
+    EMULATOR_DEF_ID,
+    EMULATOR_DEVICE,
+    EMULATOR_MARGINAL_ERROR_RATE,
+    EMULATOR_STATUS_READY,
+    EMULATOR_T_ERASE_US,
+    EMULATOR_T_PROG_US,
+    EMULATOR_T_READ_US,
+    PROTOCOL_VERSION,
+)
+from .crc import CRC16_START, CRC32_START, crc16, crc32
+from .image import BlankMap
+from .logger import ERROR, Logger
+from .nand import Nand
+from .protocol import (
+    CMD_BOOTLOADER,
+    CMD_ERROR,
+    CMD_ERROR_CRC,
+    CMD_ERROR_NOT_SUPPORTED,
+    CMD_ERROR_TRANSFER,
+    CMD_NAND_BLOCK_ERASE,
+    CMD_NAND_ID_CONFIG,
+    CMD_NAND_ID_READ,
+    CMD_NAND_PAGE_READ,
+    CMD_NAND_PAGE_READ_VOTE,
+    CMD_NAND_PAGE_WRITE,
+    CMD_NAND_STATUS,
+    CMD_PING,
+    CMD_RESTART,
+    CMD_UNKNOWN,
+    NAND_ERASE_NOWAIT,
+    NAND_VOTE_MAX_READS,
+    PAGE_ADDR_SIZE,
+    PKT_CRC16_STRUCT,
+    PKT_CRC32_STRUCT,
+    PKT_HDR_LEN,
+    PKT_HDR_STRUCT,
+    PKT_MAGIC,
+    IOBootloaderRX,
+    IOErrorRX,
+    IONandConfigRX,
+    IONandIdRX,
+    IONandStatusRX,
+    IONandVoteRX,
+    IOPingRX,
+    IORestartRX,
+    pkt_sync_offset,
+)
+
+
+class NandModel:
+    """File backed NAND array.
+
+    Geometry is the one the host derives from the ID bytes. Programming can
+    only clear bits and erasing sets a whole block back to 0xFF, like a real
+    array.
+    """
+
+    def __init__(self, nand_id, image=None):
+        """Init NAND model."""
+        self.nand_id = IONandIdRX(*nand_id)
+        self.nand = Nand(Logger(level=ERROR))
+        if not self.nand.identify(self.nand_id):
+            raise ValueError("Unknown NAND ID %s" % bytes(nand_id).hex())
+
+        self.raw_page_size = self.nand.raw_page_size
+        self.block_pages = self.nand.block_pages
+        self.pages = self.nand.pages
+        size = self.pages * self.raw_page_size
+
+        self.fd = None
+        if image:
+            self.fd = open(image, "a+b")
+            # Fresh areas of the image are erased
+            blank = b"\xff" * self.raw_page_size
+            while self.fd.tell() < size:
+                self.fd.write(blank[: size - self.fd.tell()])
+            self.fd.flush()
+            self.array = mmap.mmap(self.fd.fileno(), size)
+            self.unsparse(image)
+        else:
+            self.array = bytearray(b"\xff" * size)
+
+    def unsparse(self, image):
+        """Fill the holes of a sparse dump used as image.
+
+        Programs would make the blank page bitmap stale, so it is removed
+        once its pages are 0xFF in the image.
+        """
+        blank_map = BlankMap(image)
+        if not blank_map.load() or blank_map.raw_page_size != self.raw_page_size:
+            return
+        blank = b"\xff" * self.raw_page_size
+        for page in range(min(blank_map.pages, self.pages)):
+            if blank_map.is_blank(page):
+                offset = page * self.raw_page_size
+                self.array[offset : offset + self.raw_page_size] = blank
+        self.array.flush()
+        blank_map.remove()
+
+    def close(self):
+        """Close NAND model."""
+        if self.fd:
+            self.array.close()
+            self.fd.close()
+            self.fd = None
+
+    def erase(self, row):
+        """Erase the block holding a page."""
+        first = row // self.block_pages * self.block_pages
+        if first >= self.pages:
+            return
+        start = first * self.raw_page_size
+        end = start + self.block_pages * self.raw_page_size
+        self.array[start:end] = b"\xff" * (end - start)
+
+    def program(self, row, column, data):
+        """Program page data at a column."""
+        if row >= self.pages:
+            return
+        start = row * self.raw_page_size + column
+        end = min(start + len(data), (row + 1) * self.raw_page_size)
+        length = end - start
+        current = int.from_bytes(self.array[start:end], "little")
+        current &= int.from_bytes(data[:length], "little")
+        self.array[start:end] = current.to_bytes(length, "little")
+
+    def read(self, row, column, length):
+        """Read page data from a column, past the page end reads 0xFF."""
+        data = bytearray(b"\xff" * length)
+        if row < self.pages and column < self.raw_page_size:
+            start = row * self.raw_page_size + column
+            chunk = min(length, self.raw_page_size - column)
+            data[:chunk] = self.array[start : start + chunk]
+        return data
+
+
+# A pyserial like port plus one handler per device command
+class Emulator:  # pylint: disable=too-many-public-methods
+    """NAND IO device emulator.
+
+    Speaks the device packet protocol. It can be handed to NandIO in process,
+    where it behaves like a pyserial port, or served on a pseudo-terminal.
+    NAND operations and the USB link are timed on a device clock and
+    responses only become readable once the device would have sent them.
+    Bit errors can be injected in page reads, CRC errors and lost bytes in
+    responses, and reads configured faster than the minimum timings get marginal data.
+    """
+
+    def __init__(
+        self,
+        *,
+        nand_id=EMULATOR_DEF_ID,
+        image=None,
+        t_read_us=EMULATOR_T_READ_US,
+        t_prog_us=EMULATOR_T_PROG_US,
+        t_erase_us=EMULATOR_T_ERASE_US,
+        bandwidth=0,
+        bit_error_rate=0.0,
+        byte_drop_rate=0.0,
+        crc_error_rate=0.0,
+        min_read_delay_us=0,
+        min_re_nops=0,
+        seed=None,
+    ):
+        """Init emulator."""
+        self.model = NandModel(nand_id, image)
+        self.t_read = t_read_us / 1e6
+        self.t_prog = t_prog_us / 1e6
+        self.t_erase = t_erase_us / 1e6
+        self.bandwidth = bandwidth
+        self.bit_error_rate = bit_error_rate
+        self.byte_drop_rate = byte_drop_rate
+        self.crc_error_rate = crc_error_rate
+        self.min_read_delay_us = min_read_delay_us
+        self.min_re_nops = min_re_nops
+        self.random = random.Random(seed)
+
+        self.timeout = 1
+        self.raw_page_size = 0
+        self.read_delay = 0.0
+        self.read_error_rate = bit_error_rate
+        self.rx = bytearray()
+        self.rx_resync = False
+        self.tx = collections.deque()
+        self.tx_offset = 0
+        self.cond = threading.Condition()
+        self.clock = 0.0
+        self.array_busy = 0.0
+        self.erase_pending = False
+        self.stats = collections.Counter()
+
+        self.handlers = {
+            CMD_BOOTLOADER: self.cmd_bootloader,
+            CMD_NAND_BLOCK_ERASE: self.cmd_nand_block_erase,
+            CMD_NAND_ID_CONFIG: self.cmd_nand_id_config,
+            CMD_NAND_ID_READ: self.cmd_nand_id_read,
+            CMD_NAND_PAGE_READ: self.cmd_nand_page_read,
+            CMD_NAND_PAGE_READ_VOTE: self.cmd_nand_page_read_vote,
+            CMD_NAND_PAGE_WRITE: self.cmd_nand_page_write,
+            CMD_NAND_STATUS: self.cmd_nand_status,
+            CMD_PING: self.cmd_ping,
+            CMD_RESTART: self.cmd_restart,
+        }
+
+    # pyserial port interface
+
+    def close(self):
+        """Close port."""
+        self.model.close()
+
+    def flush(self):
+        """Flush port."""
+
+    def read(self, size=1):
+        """Read from port."""
+        buffer = bytearray(size)
+        length = self.readinto(buffer)
+        return bytes(buffer[:length])
+
+    def readinto(self, buffer):
+        """Read from port into buffer, waiting up to timeout."""
+        view = memoryview(buffer).cast("B")
+        length = 0
+        deadline = time.perf_counter() + self.timeout
+        with self.cond:
+            while length < len(view):
+                now = time.perf_counter()
+                if not self.tx or self.tx[0][0] > now:
+                    if now >= deadline:
+                        break
+                    wait = deadline - now
+                    if self.tx:
+                        wait = min(wait, self.tx[0][0] - now)
+                    self.cond.wait(wait)
+                    continue
+
+                data = self.tx[0][1]
+                chunk = min(len(view) - length, len(data) - self.tx_offset)
+                view[length : length + chunk] = data[
+                    self.tx_offset : self.tx_offset + chunk
+                ]
+                length += chunk
+                self.tx_offset += chunk
+                if self.tx_offset == len(data):
+                    self.tx.popleft()
+                    self.tx_offset = 0
+        return length
+
+    def write(self, data):
+        """Write to port, complete packets are processed straight away."""
+        with self.cond:
+            self.rx += data
+            self.process()
+            self.cond.notify_all()
+        return len(data)
+
+    # Device
+
+    def link_time(self, length):
+        """Time spent moving bytes over the USB link."""
+        if self.bandwidth:
+            return length / self.bandwidth
+        return 0.0
+
+    def nand_busy(self, start, duration):
+        """Run a NAND operation after any running erase."""
+        start = max(start, self.array_busy)
+        self.erase_pending = False
+        self.array_busy = start + duration
+        return self.array_busy
+
+    def process(self):
+        """Process every complete packet received."""
+        while len(self.rx) >= PKT_HDR_LEN:
+            now = time.perf_counter()
+            magic, cmd, data_len = PKT_HDR_STRUCT.unpack_from(self.rx)
+            (hdr_crc,) = PKT_CRC16_STRUCT.unpack_from(self.rx, PKT_HDR_STRUCT.size)
+            if (
+                magic != PKT_MAGIC
+                or crc16(CRC16_START, self.rx, PKT_HDR_STRUCT.size) != hdr_crc
+            ):
+                # Drop corrupt bytes up to the next possible header
+                offset = pkt_sync_offset(bytes(self.rx[:PKT_HDR_LEN]))
+                del self.rx[:offset]
+                self.stats["rx_dropped"] += offset
+                if not self.rx_resync:
+                    self.rx_resync = True
+                    self.stats["resyncs"] += 1
+                continue
+            if self.rx_resync:
+                # Answers the corrupt packet, keeping responses in step
+                self.rx_resync = False
+                self.send(now, CMD_ERROR, IOErrorRX(CMD_ERROR_TRANSFER))
+
+            pkt_len = PKT_HDR_LEN
+            if data_len:
+                pkt_len += data_len + PKT_CRC32_STRUCT.size
+            if len(self.rx) < pkt_len:
+                break
+
+            data = bytes(self.rx[PKT_HDR_LEN : PKT_HDR_LEN + data_len])
+            data_ok = True
+            if data_len:
+                (data_crc,) = PKT_CRC32_STRUCT.unpack_from(
+                    self.rx, PKT_HDR_LEN + data_len
+                )
+                data_ok = crc32(CRC32_START, data, data_len) == data_crc
+            del self.rx[:pkt_len]
+
+            start = max(now, self.clock) + self.link_time(pkt_len)
+            self.stats["packets"] += 1
+            handler = self.handlers.get(cmd)
+            if handler is None:
+                res = CMD_UNKNOWN
+            else:
+                res = handler(start, data, data_ok)
+            if res:
+                self.send(start, CMD_ERROR, IOErrorRX(res))
+
+    def send(self, start, cmd, data):
+        """Queue a response packet."""
+        if data is not None:
+            data = bytes(data)
+        pkt = bytearray(PKT_HDR_LEN)
+        PKT_HDR_STRUCT.pack_into(pkt, 0, PKT_MAGIC, cmd, len(data) if data else 0)
+        PKT_CRC16_STRUCT.pack_into(
+            pkt,
+            PKT_HDR_STRUCT.size,
+            crc16(CRC16_START, pkt, PKT_HDR_STRUCT.size),
+        )
+        if data:
+            crc = crc32(CRC32_START, data, len(data))
+            if self.crc_error_rate and self.random.random() < self.crc_error_rate:
+                crc ^= 1 << self.random.randrange(32)
+                self.stats["crc_errors"] += 1
+            pkt += data
+            pkt += PKT_CRC32_STRUCT.pack(crc)
+        if self.byte_drop_rate and self.random.random() < self.byte_drop_rate:
+            del pkt[self.random.randrange(len(pkt))]
+            self.stats["tx_dropped"] += 1
+
+        ready = max(start, self.clock) + self.link_time(len(pkt))
+        self.clock = ready
+        self.tx.append((ready, bytes(pkt)))
+
+    def bit_errors(self, length):
+        """Random bit positions flipped in a read."""
+        expected = length * 8 * self.read_error_rate
+        flips = int(expected)
+        if self.random.random() < expected - flips:
+            flips += 1
+        return [self.random.randrange(length * 8) for _ in range(flips)]
+
+    def decode_addr(self, addr):
+        """Decode a page address into (row, column)."""
+        addr_len = min(addr[PAGE_ADDR_SIZE], PAGE_ADDR_SIZE)
+        cols = 2 if addr_len == PAGE_ADDR_SIZE else 1
+        column = int.from_bytes(addr[:cols], "little")
+        row = int.from_bytes(addr[cols:addr_len], "little")
+        return row, column
+
+    def decode_block(self, addr):
+        """Decode a block erase (row only) address."""
+        addr_len = min(addr[PAGE_ADDR_SIZE], PAGE_ADDR_SIZE)
+        return int.from_bytes(addr[:addr_len], "little")
+
+    def read_page(self, row, column, length):
+        """Sense a page with injected bit errors."""
+        data = self.model.read(row, column, length)
+        if self.read_error_rate:
+            for bit in self.bit_errors(length):
+                data[bit >> 3] ^= 1 << (bit & 7)
+                self.stats["bit_errors"] += 1
+        return data
+
+    def cmd_bootloader(self, start, _data, _data_ok):
+        """Enter bootloader, not supported."""
+        self.send(start, CMD_BOOTLOADER, IOBootloaderRX(0))
+        return CMD_ERROR_NOT_SUPPORTED
+
+    def cmd_nand_block_erase(self, start, data, data_ok):
+        """Block erase."""
+        if not data_ok or len(data) < PAGE_ADDR_SIZE + 2:
+            return CMD_ERROR_CRC
+
+        status = IONandStatusRX(status=EMULATOR_STATUS_READY)
+        self.model.erase(self.decode_block(data))
+        self.stats["erases"] += 1
+        if data[PAGE_ADDR_SIZE + 1] & NAND_ERASE_NOWAIT:
+            start = max(start, self.array_busy)
+            self.array_busy = start + self.t_erase
+            self.erase_pending = True
+        else:
+            start = self.nand_busy(start, self.t_erase)
+        self.send(start, CMD_NAND_BLOCK_ERASE, status)
+        return 0
+
+    def cmd_nand_id_config(self, _start, data, data_ok):
+        """NAND configuration, no response."""
+        if data_ok and len(data) == ctypes.sizeof(IONandConfigRX):
+            config = IONandConfigRX.from_buffer_copy(data)
+            self.raw_page_size = config.raw_page_size
+            self.read_delay = config.read_delay_us / 1e6
+            # A zero read delay waits for ready/busy, which is always safe
+            marginal = config.re_delay_nops < self.min_re_nops or (
+                0 < config.read_delay_us < self.min_read_delay_us
+            )
+            self.read_error_rate = self.bit_error_rate
+            if marginal:
+                self.read_error_rate += EMULATOR_MARGINAL_ERROR_RATE
+        return 0
+
+    def cmd_nand_id_read(self, start, _data, _data_ok):
+        """Read NAND ID."""
+        self.send(start, CMD_NAND_ID_READ, self.model.nand_id)
+        return 0
+
+    def cmd_nand_page_read(self, start, data, data_ok):
+        """Page read."""
+        if not data_ok or len(data) < PAGE_ADDR_SIZE + 1:
+            return CMD_ERROR_CRC
+        row, column = self.decode_addr(data)
+        start = self.nand_busy(start, self.t_read + self.read_delay)
+        self.stats["reads"] += 1
+        self.send(
+            start,
+            CMD_NAND_PAGE_READ,
+            self.read_page(row, column, self.raw_page_size),
+        )
+        return 0
+
+    def cmd_nand_page_read_vote(self, start, data, data_ok):
+        """Page majority vote read."""
+        if not data_ok or len(data) < PAGE_ADDR_SIZE + 2:
+            return CMD_ERROR_CRC
+        reads = data[PAGE_ADDR_SIZE + 1]
+        if not reads or reads > NAND_VOTE_MAX_READS:
+            return CMD_ERROR_NOT_SUPPORTED
+
+        row, column = self.decode_addr(data)
+        length = self.raw_page_size
+        page = self.model.read(row, column, length)
+        flips = collections.Counter()
+        if self.read_error_rate:
+            for _ in range(reads):
+                flips.update(set(self.bit_errors(length)))
+
+        unstable = 0
+        for bit, count in flips.items():
+            value = (page[bit >> 3] >> (bit & 7)) & 1
+            ones = count if value == 0 else reads - count
+            if count != reads:
+                unstable += 1
+            if (ones * 2 >= reads) != bool(value):
+                page[bit >> 3] ^= 1 << (bit & 7)
+
+        start = self.nand_busy(start, (self.t_read + self.read_delay) * reads)
+        self.stats["reads"] += reads
+        self.send(
+            start,
+            CMD_NAND_PAGE_READ_VOTE,
+            bytes(page) + bytes(IONandVoteRX(unstable)),
+        )
+        return 0
+
+    def cmd_nand_page_write(self, start, data, data_ok):
+        """Page write."""
+        if len(data) != PAGE_ADDR_SIZE + 2 + self.raw_page_size:
+            return CMD_ERROR_TRANSFER
+        if not data_ok:
+            return CMD_ERROR_CRC
+
+        row, column = self.decode_addr(data)
+        self.model.program(row, column, data[PAGE_ADDR_SIZE + 2 :])
+        self.stats["programs"] += 1
+        start = self.nand_busy(start, self.t_prog)
+        self.send(
+            start,
+            CMD_NAND_PAGE_WRITE,
+            IONandStatusRX(status=EMULATOR_STATUS_READY),
+        )
+        return 0
+
+    def cmd_nand_status(self, start, _data, _data_ok):
+        """NAND status."""
+        if self.erase_pending:
+            start = self.nand_busy(start, 0)
+        self.send(
+            start,
+            CMD_NAND_STATUS,
+            IONandStatusRX(status=EMULATOR_STATUS_READY),
+        )
+        return 0
+
+    def cmd_ping(self, start, _data, _data_ok):
+        """Ping."""
+        self.send(
+            start,
+            CMD_PING,
+            IOPingRX(
+                device=EMULATOR_DEVICE,
+                version=PROTOCOL_VERSION,
+                serial_speed=self.bandwidth * 10,
+                memory_free=0,
+                resyncs=self.stats["resyncs"],
+            ),
+        )
+        return 0
+
+    def cmd_restart(self, start, _data, _data_ok):
+        """Restart, not supported."""
+        self.send(start, CMD_RESTART, IORestartRX(0))
+        return CMD_ERROR_NOT_SUPPORTED
+
+    # Pseudo-terminal transport
+
+    def serve_pty(self, link=None):
+        """Serve the emulator on a pseudo-terminal until interrupted."""
+        master, slave = os.openpty()
+        tty.setraw(slave)
+        path = os.ttyname(slave)
+        if link:
+            if os.path.lexists(link):
+                os.remove(link)
+            os.symlink(path, link)
+            path = link
+        print("Emulator on %s" % path, flush=True)
+
+        try:
+            while True:
+                with self.cond:
+                    wait = None
+                    if self.tx:
+                        wait = max(self.tx[0][0] - time.perf_counter(), 0)
+                readable, _, _ = select.select([master], [], [], wait)
+                if readable:
+                    self.write(os.read(master, 65536))
+                with self.cond:
+                    now = time.perf_counter()
+                    while self.tx and self.tx[0][0] <= now:
+                        _, data = self.tx.popleft()
+                        os.write(master, data)
+        except KeyboardInterrupt:
+            pass
+        finally:
+            if link and os.path.islink(link):
+                os.remove(link)
+            os.close(master)
+            os.close(slave)
+            self.close()
+
+
+def main():
+    """NAND IO device emulator."""
+    parser = argparse.ArgumentParser(description="")
+
+    parser.add_argument(
+        "--bandwidth",
+        dest="bandwidth",
+        action="store",
+        type=int,
+        default=0,
+        help="USB bandwidth in bytes/s (0 for unlimited)",
+    )
+
+    parser.add_argument(
+        "--bit-error-rate",
+        dest="bit_error_rate",
+        action="store",
+        type=float,
+        default=0.0,
+        help="Probability of a bit flip on every page read",
+    )
+
+    parser.add_argument(
+        "--byte-drop-rate",
+        dest="byte_drop_rate",
+        action="store",
+        type=float,
+        default=0.0,
+        help="Probability of a byte lost from a response",
+    )
+
+    parser.add_argument(
+        "--crc-error-rate",
+        dest="crc_error_rate",
+        action="store",
+        type=float,
+        default=0.0,
+        help="Probability of a corrupted response CRC",
+    )
+
+    parser.add_argument(
+        "--id",
+        dest="nand_id",
+        action="store",
+        type=bytes.fromhex,
+        default=bytes(EMULATOR_DEF_ID),
+        help="NAND ID bytes in hex (default %s)" % bytes(EMULATOR_DEF_ID).hex(),
+    )
+
+    parser.add_argument(
+        "--image",
+        dest="image",
+        action="store",
+        type=str,
+        help="NAND image backing file (in memory if missing)",
+    )
+
+    parser.add_argument(
+        "--min-re-nops",
+        dest="min_re_nops",
+        action="store",
+        type=int,
+        default=0,
+        help="Minimum RE# delay (NOPs), faster reads get bit errors",
+    )
+
+    parser.add_argument(
+        "--min-read-delay",
+        dest="min_read_delay_us",
+        action="store",
+        type=int,
+        default=0,
+        help="Minimum read delay (us), faster reads get bit errors",
+    )
+
+    parser.add_argument(
+        "--pty",
+        dest="pty",
+        action="store",
+        type=str,
+        help="Symlink created to the pseudo-terminal",
+    )
+
+    parser.add_argument(
+        "--t-erase",
+        dest="t_erase",
+        action="store",
+        type=float,
+        default=EMULATOR_T_ERASE_US,
+        help="Block erase time (us)",
+    )
+
+    parser.add_argument(
+        "--t-prog",
+        dest="t_prog",
+        action="store",
+        type=float,
+        default=EMULATOR_T_PROG_US,
+        help="Page program time (us)",
+    )
+
+    parser.add_argument(
+        "--t-read",
+        dest="t_read",
+        action="store",
+        type=float,
+        default=EMULATOR_T_READ_US,
+        help="Page read time (us)",
+    )
+
+    args = parser.parse_args()
+
+    emulator = Emulator(
+        nand_id=args.nand_id.ljust(5, b"\0")[:5],
+        image=args.image,
+        t_read_us=args.t_read,
+        t_prog_us=args.t_prog,
+        t_erase_us=args.t_erase,
+        bandwidth=args.bandwidth,
+        bit_error_rate=args.bit_error_rate,
+        byte_drop_rate=args.byte_drop_rate,
+        crc_error_rate=args.crc_error_rate,
+        min_read_delay_us=args.min_read_delay_us,
+        min_re_nops=args.min_re_nops,
+    )
+    emulator.serve_pty(args.pty)
+
+
+if __name__ == "__main__":
+    main()
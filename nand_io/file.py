@@ -0,0 +1,157 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO file-like view."""
+
+import collections
+import io
+
+from .const import FILE_CACHE_PAGES, FILE_READAHEAD_PAGES
+
+
+class PageCache:
+    """LRU cache of raw pages."""
+
+    def __init__(self, pages):
+        """Init page cache."""
+        self.pages = pages
+        self.entries = collections.OrderedDict()
+        self.hits = 0
+        self.misses = 0
+
+    def __contains__(self, page):
+        """Check if a page is cached."""
+        return page in self.entries
+
+    def __len__(self):
+        """Number of cached pages."""
+        return len(self.entries)
+
+    def discard(self, start, count=1):
+        """Drop a range of pages."""
+        if count > len(self.entries):
+            for page in [
+                page for page in self.entries if start <= page < start + count
+            ]:
+                del self.entries[page]
+        else:
+            for page in range(start, start + count):
+                self.entries.pop(page, None)
+
+    def get(self, page):
+        """Cached raw page or None."""
+        data = self.entries.get(page)
+        if data is None:
+            self.misses += 1
+            return None
+        self.hits += 1
+        self.entries.move_to_end(page)
+        return data
+
+    def put(self, page, data):
+        """Cache a raw page, evicting the least recently used ones."""
+        self.entries[page] = data
+        self.entries.move_to_end(page)
+        while len(self.entries) > self.pages:
+            self.entries.popitem(last=False)
+
+
+class NandFile(io.RawIOBase):
+    """Seekable read-only view of a NAND.
+
+    Addresses page data only, or whole raw pages with their OOB. Pages are
+    kept in an LRU cache. Misses read a batch of pages through a pipelined
+    stream, which grows while accesses stay sequential and falls back to a
+    single page on random access, so scattered reads only touch the pages
+    they need.
+    """
+
+    def __init__(
+        self,
+        nand_io,
+        *,
+        raw=False,
+        cache_pages=FILE_CACHE_PAGES,
+        readahead_pages=FILE_READAHEAD_PAGES,
+    ):
+        """Init NAND file."""
+        super().__init__()
+        nand = nand_io.nand
+        self.nand_io = nand_io
+        self.pages = nand.pages
+        if raw:
+            self.page_size = nand.raw_page_size
+        else:
+            self.page_size = nand.page_size
+        self.size = self.pages * self.page_size
+        self.cache = PageCache(max(cache_pages, readahead_pages))
+        self.readahead_pages = readahead_pages
+        self.readahead = 1
+        self.last_page = -1
+        self.position = 0
+        self.batches = 0
+
+    def readable(self):
+        """File is readable."""
+        return True
+
+    def seekable(self):
+        """File is seekable."""
+        return True
+
+    def seek(self, offset, whence=io.SEEK_SET):
+        """Change the file position."""
+        if whence == io.SEEK_CUR:
+            offset += self.position
+        elif whence == io.SEEK_END:
+            offset += self.size
+        elif whence != io.SEEK_SET:
+            raise ValueError("invalid whence (%r)" % whence)
+        if offset < 0:
+            raise ValueError("negative seek position %d" % offset)
+        self.position = offset
+        return self.position
+
+    def tell(self):
+        """Current file position."""
+        return self.position
+
+    def readinto(self, buffer):
+        """Read into a buffer, returns the number of bytes read."""
+        view = memoryview(buffer).cast("B")
+        length = max(min(len(view), self.size - self.position), 0)
+        done = 0
+        while done < length:
+            page, offset = divmod(self.position, self.page_size)
+            chunk = min(self.page_size - offset, length - done)
+            view[done : done + chunk] = self.page(page)[offset : offset + chunk]
+            done += chunk
+            self.position += chunk
+        return done
+
+    def page(self, page):
+        """Raw page through the cache."""
+        sequential = page == self.last_page + 1
+        self.last_page = page
+
+        data = self.cache.get(page)
+        if data is not None:
+            return data
+
+        if sequential:
+            self.readahead = min(self.readahead * 2, self.readahead_pages)
+        else:
+            self.readahead = 1
+        self.fetch(page, self.readahead)
+
+        return self.cache.get(page)
+
+    def fetch(self, start, count):
+        """Read a batch of pages missing from the cache."""
+        end = min(start + count, self.pages)
+        for page in range(start + 1, end):
+            if page in self.cache:
+                end = page
+                break
+
+        self.batches += 1
+        for page, data, oob in self.nand_io.iter_pages(start, end - start):
+            self.cache.put(page, bytes(data) + bytes(oob))
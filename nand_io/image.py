@@ -0,0 +1,190 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO raw image analysis."""
+
+import json
+import os
+
+from .const import BLANK_SUFFIX, BLANK_VERSION
+
+
+class BlankMap:
+    """Blank page bitmap.
+
+    Sidecar file next to a sparse dump. Blank pages aren't written to the
+    dump, which leaves filesystem holes that read back as 0x00, so the bitmap
+    is needed to restore them as 0xFF. Every reader in NAND IO goes through
+    open_image(), plain tools like cmp or dd see the zeros.
+    """
+
+    def __init__(self, file, pages=0, raw_page_size=0):
+        """Init blank page bitmap."""
+        self.file = file + BLANK_SUFFIX
+        self.pages = pages
+        self.raw_page_size = raw_page_size
+        self.bitmap = bytearray((pages + 7) // 8)
+
+    def header(self):
+        """Bitmap header."""
+        return {
+            "version": BLANK_VERSION,
+            "pages": self.pages,
+            "raw_page_size": self.raw_page_size,
+        }
+
+    def is_blank(self, page):
+        """Check if page is blank."""
+        return bool(self.bitmap[page >> 3] & (1 << (page & 7)))
+
+    def load(self):
+        """Load bitmap, returns False if missing or not matching."""
+        try:
+            bitmap_file = open(self.file, "rb")
+        except OSError:
+            return False
+        try:
+            header = json.loads(bitmap_file.readline())
+            bitmap = bitmap_file.read()
+        except ValueError:
+            header = None
+            bitmap = b""
+        bitmap_file.close()
+
+        if not isinstance(header, dict) or header.get("version") != BLANK_VERSION:
+            return False
+        if self.pages and header != self.header():
+            return False
+        pages = header.get("pages", 0)
+        if len(bitmap) != (pages + 7) // 8:
+            return False
+
+        self.pages = pages
+        self.raw_page_size = header.get("raw_page_size", 0)
+        self.bitmap = bytearray(bitmap)
+        return True
+
+    def mark(self, page):
+        """Mark page as blank."""
+        self.bitmap[page >> 3] |= 1 << (page & 7)
+
+    def remove(self):
+        """Remove bitmap."""
+        if os.path.exists(self.file):
+            os.remove(self.file)
+
+    def sync(self):
+        """Write bitmap to disk."""
+        tmp_file = self.file + ".tmp"
+        bitmap_file = open(tmp_file, "wb")
+        bitmap_file.write(json.dumps(self.header(), sort_keys=True).encode() + b"\n")
+        bitmap_file.write(self.bitmap)
+        bitmap_file.flush()
+        os.fsync(bitmap_file.fileno())
+        bitmap_file.close()
+        os.replace(tmp_file, self.file)
+
+
+class SparseImage:
+    """Sparse dump reader returning the byte stream read from the NAND."""
+
+    def __init__(self, file, blank_map):
+        """Init sparse dump reader."""
+        self.inp = open(file, "rb")
+        self.blank_map = blank_map
+        self.offset = 0
+
+    def __enter__(self):
+        """Enter context."""
+        return self
+
+    def __exit__(self, *args):
+        """Exit context."""
+        self.close()
+
+    def close(self):
+        """Close sparse dump."""
+        self.inp.close()
+
+    def read(self, size=-1):
+        """Read from sparse dump."""
+        self.inp.seek(self.offset)
+        data = self.inp.read(size)
+        if not data:
+            return data
+
+        raw_page_size = self.blank_map.raw_page_size
+        end = self.offset + len(data)
+        first = self.offset // raw_page_size
+        last = (end - 1) // raw_page_size
+        filled = None
+        for page in range(first, min(last + 1, self.blank_map.pages)):
+            if not self.blank_map.is_blank(page):
+                continue
+            if filled is None:
+                filled = bytearray(data)
+            start = max(page * raw_page_size, self.offset) - self.offset
+            stop = min((page + 1) * raw_page_size, end) - self.offset
+            filled[start:stop] = b"\xff" * (stop - start)
+
+        self.offset = end
+        if filled is None:
+            return data
+        return bytes(filled)
+
+    def seek(self, offset, whence=os.SEEK_SET):
+        """Seek sparse dump."""
+        self.offset = self.inp.seek(offset, whence)
+        return self.offset
+
+    def tell(self):
+        """Sparse dump position."""
+        return self.offset
+
+
+def open_image(file):
+    """Open a raw image, restoring blank pages of sparse dumps."""
+    blank_map = BlankMap(file)
+    if blank_map.load():
+        return SparseImage(file, blank_map)
+    return open(file, "rb")
+
+
+def blank_blocks(file, raw_block_size, blocks):
+    """Return the set of blocks that are entirely 0xFF in a raw image."""
+    blank = set()
+    blank_bytes = b"\xff" * raw_block_size
+    blocks = min(blocks, os.path.getsize(file) // raw_block_size)
+
+    with open_image(file) as inp:
+        for block in range(blocks):
+            if inp.read(raw_block_size) == blank_bytes:
+                blank.add(block)
+
+    return blank
+
+
+def write_plan(file, raw_page_size, block_pages, pages, blank=None):
+    """Plan writing a raw image.
+
+    Returns (block, erase, pages) for every block that has to be touched, with
+    the pages holding data in program order. Blank pages are never programmed
+    and blocks are only erased unless they are known to be blank already.
+    """
+    plan = []
+    blank_bytes = b"\xff" * raw_page_size
+    if blank is None:
+        blank = set()
+
+    with open_image(file) as inp:
+        for first in range(0, pages, block_pages):
+            block = first // block_pages
+            data_pages = []
+            for page in range(first, min(first + block_pages, pages)):
+                page_bytes = inp.read(raw_page_size)
+                if page_bytes != blank_bytes[: len(page_bytes)]:
+                    data_pages.append(page)
+
+            erase = block not in blank
+            if erase or data_pages:
+                plan.append((block, erase, data_pages))
+
+    return plan
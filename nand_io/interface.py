@@ -1,35 +1,70 @@
 # SPDX-License-Identifier: MIT
 """NAND IO interface."""
 
+import asyncio
+import ctypes
 import sys
 
 import serial
 
+from .badblock import BadBlockScan
 from .common import convert_size, ctypes_from_bytes
-from .const import PAGE_RW_RETRIES, PROTOCOL_VERSION, SERIAL_DEF_SPEED, SERIAL_DEVICES
+from .const import (
+    CONTAINER_BLANK,
+    ECC_REREAD_SETTINGS,
+    NAND_STATUS_FAIL,
+    NAND_STATUS_FAILC,
+    NAND_STATUS_RDY,
+    PAGE_RW_RETRIES,
+    PROTOCOL_VERSION,
+    SERIAL_DEF_SPEED,
+    SERIAL_DEVICES,
+    TUNE_RE_DELAY_NOPS,
+)
 from .crc import CRC16_START, CRC32_START, crc16, crc32
+from .file import NandFile
 from .logger import INFO, Logger
+from .metrics import ReadMetrics
 from .nand import Nand
+from .output import ReadOutput
+from .pipeline import ReadPipeline
 from .protocol import (
     CMD_BOOTLOADER,
+    CMD_ERROR,
+    CMD_NAND_BLOCK_ERASE,
     CMD_NAND_ID_CONFIG,
     CMD_NAND_ID_READ,
     CMD_NAND_PAGE_READ,
+    CMD_NAND_PAGE_READ_VOTE,
+    CMD_NAND_PAGE_WRITE,
+    CMD_NAND_STATUS,
     CMD_PING,
     CMD_RESTART,
+    PKT_CRC16_STRUCT,
+    PKT_CRC32_STRUCT,
+    PKT_HDR_LEN,
+    PKT_HDR_STRUCT,
     PKT_MAGIC,
     IOBootloaderRX,
-    IOCrc16,
     IOCrc32,
+    IOErrorRX,
     IONandIdRX,
-    IOPacketHeader,
+    IONandStatusRX,
+    IONandVoteRX,
     IOPingRX,
     IORestartRX,
+    pkt_data_ok,
+    pkt_sync_offset,
 )
 from .serial import SerialDevice
+from .serve import NandServer
+from .stream import PageStream
+from .tuning import ReadTuner, TimingCache, programmer_id
+from .writer import PageWriter
 
 
-class NandIO:
+# One method per device command and per operation built on them
+class NandIO:  # pylint: disable=too-many-public-methods
     """NAND IO."""
 
     def __init__(
@@ -46,7 +81,28 @@ class NandIO:
         self.serial_device = serial_device
         self.serial_speed = serial_speed
         self.serial = None
+        self.device = None
         self.nand = None
+        self.rx_dropped = 0
+        self.rx_pending = bytearray()
+        self.rx_resyncs = 0
+
+        # Reused by every packet sent
+        self.tx_hdr = bytearray(PKT_HDR_STRUCT.size + PKT_CRC16_STRUCT.size)
+        self.tx_crc = bytearray(PKT_CRC32_STRUCT.size)
+
+    async def aiter_pages(self, start=0, count=None, *, votes=1):
+        """Asynchronously iterate over pages, see iter_pages()."""
+        loop = asyncio.get_running_loop()
+        pages = self.iter_pages(start, count, votes=votes)
+        try:
+            while True:
+                item = await loop.run_in_executor(None, next, pages, None)
+                if item is None:
+                    break
+                yield item
+        finally:
+            await loop.run_in_executor(None, pages.close)
 
     def bootloader(self):
         """Enter device bootloader."""
@@ -69,6 +125,15 @@ class NandIO:
         if self.serial:
             self.serial.close()
 
+    def iter_pages(self, start=0, count=None, *, votes=1):
+        """Iterate over pages as (page, data, oob) without a dump file.
+
+        Data and OOB are memoryviews only valid until the next page.
+        """
+        if count is None:
+            count = self.nand.pages - start
+        return iter(PageStream(self, range(start, start + count), votes=votes))
+
     def open(self):
         """Open serial device."""
         try:
@@ -82,6 +147,10 @@ class NandIO:
 
         return True
 
+    def open_file(self, *, raw=False):
+        """Open a seekable file-like view of the NAND data or raw pages."""
+        return NandFile(self, raw=raw)
+
     def ping(self):
         """Ping device."""
         self.pkt_tx(CMD_PING, None)
@@ -91,6 +160,7 @@ class NandIO:
             return False
         if ping_rx.version != PROTOCOL_VERSION:
             return False
+        self.device = ping_rx.device
 
         self.log.info("Device:\n")
         if ping_rx.device in SERIAL_DEVICES:
@@ -100,36 +170,74 @@ class NandIO:
         self.log.info("\tVersion: %x\n", ping_rx.version)
         self.log.info("\tSerial speed: %u\n", ping_rx.serial_speed)
         self.log.info("\tMemory free: %s\n", convert_size(ping_rx.memory_free))
+        self.log.info("\tResyncs: %u\n", ping_rx.resyncs)
 
         return True
 
+    def pkt_check(self, cmd, _bytes, data_len):
+        """Check a raw packet received with its data."""
+        hdr_len = PKT_HDR_STRUCT.size
+        magic, hdr_cmd, hdr_data_len = PKT_HDR_STRUCT.unpack_from(_bytes)
+        if magic != PKT_MAGIC or hdr_cmd != cmd or hdr_data_len != data_len:
+            return False
+
+        (hdr_crc,) = PKT_CRC16_STRUCT.unpack_from(_bytes, hdr_len)
+        calc_crc = crc16(CRC16_START, _bytes, hdr_len)
+        if calc_crc != hdr_crc:
+            self.log.error("RX: header CRC error! (%04X vs %04X)\n", hdr_crc, calc_crc)
+            return False
+
+        data_offset = hdr_len + PKT_CRC16_STRUCT.size
+        data = memoryview(_bytes)[data_offset : data_offset + data_len]
+        (data_crc,) = PKT_CRC32_STRUCT.unpack_from(_bytes, data_offset + data_len)
+        calc_crc = crc32(CRC32_START, data, data_len)
+        if calc_crc != data_crc:
+            self.log.error("RX: data CRC error! (%08X vs %08X)\n", data_crc, calc_crc)
+            return False
+
+        return True
+
+    def pkt_barrier(self, hdr=None):
+        """Drop every response in flight, up to the one of a ping.
+
+        hdr is the header of a response already received, if any.
+        """
+        for _ in range(PAGE_RW_RETRIES):
+            self.pkt_tx(CMD_PING, None)
+            while True:
+                if hdr is None:
+                    hdr = self.pkt_rx_header()
+                    if hdr is None:
+                        break
+                cmd, data_len = hdr
+                hdr = None
+                _bytes = self.pkt_skip(data_len)
+                if cmd == CMD_PING:
+                    return True
+                if not pkt_data_ok(_bytes, data_len):
+                    # A short response ran into the next ones, scan it again
+                    self.rx_pending[:0] = _bytes
+
+        return False
+
     def pkt_rx(self, cmd, _data, _debug=False):
         """Receive packet from serial."""
-        _bytes = self.serial.read(IOPacketHeader)
+        hdr = self.pkt_rx_header()
         if _debug:
             self.log.info("pkt_rx: hdr=")
-            print(_bytes)
-        hdr = ctypes_from_bytes(IOPacketHeader, _bytes)
-
-        if hdr.magic != PKT_MAGIC:
-            return None
-        if hdr.cmd != cmd:
+            print(hdr)
+        if hdr is None:
             return None
 
-        _crc_bytes = self.serial.read(IOCrc16)
-        if _debug:
-            self.log.info("pkt_rx: crc=")
-            print(_crc_bytes)
-        hdr_crc = ctypes_from_bytes(IOCrc16, _crc_bytes)
-
-        calc_crc = crc16(CRC16_START, _bytes, len(_bytes))
-        if calc_crc != hdr_crc.crc:
-            self.log.error(
-                "RX: header CRC error! (%04X vs %04X)\n", hdr_crc.crc, calc_crc
-            )
+        if isinstance(_data, (bytes, bytearray)):
+            data_len = len(_data)
+        else:
+            data_len = ctypes.sizeof(_data)
+        if hdr != (cmd, data_len):
+            self.pkt_unexpected(*hdr)
             return None
 
-        _bytes = self.serial.read(_data)
+        _bytes = self.rx_read(data_len)
         if _debug:
             self.log.info("pkt_rx: len=%d data=", len(_bytes))
             print(_bytes)
@@ -137,7 +245,7 @@ class NandIO:
             data = _bytes
         else:
             data = ctypes_from_bytes(_data, _bytes)
-        _crc_bytes = self.serial.read(IOCrc32)
+        _crc_bytes = self.rx_read(ctypes.sizeof(IOCrc32))
         if _debug:
             self.log.info("pkt_rx: crc=")
             print(_crc_bytes)
@@ -152,6 +260,51 @@ class NandIO:
 
         return data
 
+    def pkt_rx_header(self, hdr=None):
+        """Receive a packet header, dropping any corrupt bytes before it.
+
+        Returns the command and data length, or None on timeout.
+        """
+        if hdr is None:
+            hdr = bytearray(PKT_HDR_LEN)
+        hdr = memoryview(hdr)
+        length = 0
+        resync = False
+        while True:
+            while length < PKT_HDR_LEN:
+                res = self.rx_readinto(hdr[length:])
+                if not res:
+                    return None
+                length += res
+
+            magic, cmd, data_len = PKT_HDR_STRUCT.unpack_from(hdr)
+            (hdr_crc,) = PKT_CRC16_STRUCT.unpack_from(hdr, PKT_HDR_STRUCT.size)
+            if magic == PKT_MAGIC:
+                if crc16(CRC16_START, hdr, PKT_HDR_STRUCT.size) == hdr_crc:
+                    return cmd, data_len
+
+            offset = pkt_sync_offset(hdr.tobytes())
+            hdr[: length - offset] = hdr[offset:length].tobytes()
+            length -= offset
+            self.rx_dropped += offset
+            if not resync:
+                resync = True
+                self.rx_resyncs += 1
+
+    def pkt_skip(self, data_len):
+        """Skip the data of a packet."""
+        if not data_len:
+            return b""
+        return self.rx_read(data_len + PKT_CRC32_STRUCT.size)
+
+    def pkt_unexpected(self, cmd, data_len):
+        """Drop an unexpected packet."""
+        _bytes = self.pkt_skip(data_len)
+        if cmd == CMD_ERROR and data_len == ctypes.sizeof(IOErrorRX) and _bytes:
+            self.log.error("RX: device error %d\n", _bytes[0])
+        else:
+            self.log.error("RX: unexpected packet (cmd=%02X len=%d)\n", cmd, data_len)
+
     def pkt_tx(self, cmd, data, _debug=False):
         """Send packet over serial."""
         if data:
@@ -159,71 +312,179 @@ class NandIO:
         else:
             data_len = 0
 
-        pkt_hdr = IOPacketHeader(
-            magic=PKT_MAGIC,
-            cmd=cmd,
-            data_len=data_len,
-        )
-        hdr_bytes = bytearray(pkt_hdr)
-        crc = crc16(CRC16_START, hdr_bytes, len(hdr_bytes))
-        hdr_crc = IOCrc16(crc)
+        hdr_bytes = self.tx_hdr
+        PKT_HDR_STRUCT.pack_into(hdr_bytes, 0, PKT_MAGIC, cmd, data_len)
+        crc = crc16(CRC16_START, hdr_bytes, PKT_HDR_STRUCT.size)
+        PKT_CRC16_STRUCT.pack_into(hdr_bytes, PKT_HDR_STRUCT.size, crc)
         self.serial.write(hdr_bytes)
-        self.serial.write(bytearray(hdr_crc))
         if _debug:
             self.log.info("pkt_tx: hdr=")
-            print(hdr_bytes)
-            self.log.info("pkt_tx: crc=")
-            print(bytearray(hdr_crc))
+            print(bytes(hdr_bytes))
 
         if data:
-            data_bytes = bytearray(data)
-            crc = crc32(CRC32_START, data_bytes, len(data_bytes))
-            data_crc = IOCrc32(crc)
-            self.serial.write(data_bytes)
-            self.serial.write(bytearray(data_crc))
+            crc = crc32(CRC32_START, data, data_len)
+            PKT_CRC32_STRUCT.pack_into(self.tx_crc, 0, crc)
+            self.serial.write(data)
+            self.serial.write(self.tx_crc)
             if _debug:
-                self.log.info("pkt_rx: len=%d data=", len(data_bytes))
-                print(data_bytes)
+                self.log.info("pkt_tx: len=%d data=", data_len)
+                print(bytes(data))
                 self.log.info("pkt_tx: crc=")
-                print(bytearray(data_crc))
+                print(bytes(self.tx_crc))
 
         self.serial.flush()
 
-    def read(self, file):
+    def read(
+        self,
+        file,
+        *,
+        votes=1,
+        resume=False,
+        sparse=False,
+        container=False,
+        ecc=False,
+        compress=None,
+        store=None,
+        logical=None,
+        metrics=None,
+    ):
         """Read from device."""
-        page_bytes = bytearray(self.nand.raw_page_size)
-        page = 0
-        retries = PAGE_RW_RETRIES
-
-        out = open(file, "wb")
-        while page < self.nand.pages:
-            read_tx = self.nand.page_config_bytes(page)
-            self.pkt_tx(CMD_NAND_PAGE_READ, read_tx)
-
-            page_bytes = self.pkt_rx(CMD_NAND_PAGE_READ, page_bytes)
-            if page_bytes is None:
-                retries -= 1
-                self.log.error(
-                    "\nError reading page %d! (%d retries left)\n", page, retries
-                )
-                if retries == 0:
-                    out.close()
-                    return False
-                continue
-            retries = PAGE_RW_RETRIES
-
-            out.write(bytearray(page_bytes))
-            page += 1
+        output = ReadOutput(self.log, self.nand)
+        output.open(
+            file,
+            resume=resume,
+            sparse=sparse,
+            container=container,
+            ecc=ecc,
+            compress=compress,
+            store=store,
+        )
+        if metrics is None:
+            metrics = ReadMetrics(self.log)
+        pages = output.pages
+        if pages is None:
+            pages = range(self.nand.pages)
+        if logical:
+            pages = self.read_bad_blocks(file, output, pages, logical, resume)
+            if pages is None:
+                output.close(False)
+                return False
+        metrics.begin(len(pages), self.nand.raw_page_size)
+        res = ReadPipeline(
+            self, output, votes=votes, pages=pages, metrics=metrics
+        ).run()
+        if res:
+            res = self.read_recover(output)
+        res = output.close(res)
+        metrics.close()
+
+        return res
+
+    def programmer(self):
+        """Programmer identity used for tuned timings."""
+        return programmer_id(self.device, self.serial_device)
+
+    def read_config(self, read_delay_us, re_delay_nops=None):
+        """Change the read timings of the NAND configuration."""
+        self.nand.read_delay_us = read_delay_us
+        if re_delay_nops is not None:
+            self.nand.re_delay_nops = re_delay_nops
+        self.pkt_tx(CMD_NAND_ID_CONFIG, self.nand.config_bytes())
 
-            read_percent = int(round(page * 100 / self.nand.pages, 0))
-            self.log.info(
-                "Reading NAND %d%% (page=%d/%d)\r", read_percent, page, self.nand.pages
-            )
+    def read_bad_blocks(self, file, output, pages, logical, resume):
+        """Scan bad blocks before a read, returns the pages left to read."""
+        scan = BadBlockScan(self)
+        bad_blocks = scan.run()
+        if bad_blocks is None:
+            return None
+        bad_blocks.save(file)
+        output.open_logical(logical, bad_blocks, resume)
+
+        blank = b"\xff" * self.nand.raw_page_size
+        left = []
+        skipped = 0
+        for page in pages:
+            data = scan.scanned.get(page)
+            if bad_blocks.is_bad(page // self.nand.block_pages):
+                # Unread pages of bad blocks are stored erased, never as holes
+                if data is None:
+                    data = blank
+                    skipped += 1
+            elif data is None or output.ecc is not None:
+                # Pages read by the scan are stored unless they need ECC
+                left.append(page)
+                continue
+            output.store_page(page, data, CONTAINER_BLANK if data == blank else 0)
+        self.log.info("Skipped %d pages of bad blocks, stored as erased\n", skipped)
+        return left
+
+    def read_recover(self, output):
+        """Re-read pages failing ECC correction with slower settings."""
+        stats = output.ecc_stats
+        if not stats or not stats.uncorrectable:
+            return True
+
+        self.log.warning(
+            "Re-reading %d uncorrectable pages\n", len(stats.uncorrectable)
+        )
+        read_delay_us = self.nand.read_delay_us
+        re_delay_nops = self.nand.re_delay_nops
+        res = True
+        for delay_us, votes in ECC_REREAD_SETTINGS:
+            pages = list(stats.uncorrectable)
+            if not pages:
+                break
+            # A zero read delay waits for ready/busy, only RE# is slowed down
+            if read_delay_us:
+                delay_us = max(read_delay_us, delay_us)
+            else:
+                delay_us = 0
+            self.read_config(delay_us, max(re_delay_nops, TUNE_RE_DELAY_NOPS[0]))
+            metrics = ReadMetrics(self.log, progress=False)
+            metrics.begin(len(pages), self.nand.raw_page_size)
+            res = ReadPipeline(
+                self, output, votes=votes, pages=pages, metrics=metrics
+            ).run()
+            for page in pages:
+                if page not in stats.uncorrectable:
+                    self.log.warning(
+                        "Page %d recovered (read delay %d us, RE# delay %d nops,"
+                        " %d votes)\n",
+                        page,
+                        self.nand.read_delay_us,
+                        self.nand.re_delay_nops,
+                        votes,
+                    )
+            if not res:
+                break
+        self.read_config(read_delay_us, re_delay_nops)
+
+        for page in stats.uncorrectable:
+            self.log.error("Page %d: uncorrectable ECC errors\n", page)
+
+        return res
+
+    def read_page(self, page):
+        """Read a single raw page."""
+        read_tx = self.nand.page_config_bytes(page)
+        self.pkt_tx(CMD_NAND_PAGE_READ, read_tx)
+
+        return self.pkt_rx(CMD_NAND_PAGE_READ, bytearray(self.nand.raw_page_size))
+
+    def read_page_vote(self, page, reads):
+        """Read a single raw page voted over several device side reads."""
+        vote_tx = self.nand.page_vote_bytes(page, reads)
+        self.pkt_tx(CMD_NAND_PAGE_READ_VOTE, vote_tx)
+
+        vote_len = self.nand.raw_page_size + ctypes.sizeof(IONandVoteRX)
+        vote_bytes = self.pkt_rx(CMD_NAND_PAGE_READ_VOTE, bytearray(vote_len))
+        if vote_bytes is None:
+            return None
 
-        self.log.info("\n")
-        out.close()
+        page_bytes = vote_bytes[: self.nand.raw_page_size]
+        vote_rx = ctypes_from_bytes(IONandVoteRX, vote_bytes[self.nand.raw_page_size :])
 
-        return True
+        return page_bytes, vote_rx.unstable_bits
 
     def restart(self):
         """Restart device."""
@@ -240,6 +501,39 @@ class NandIO:
             self.log.info(" Not supported!\n")
         return True
 
+    def rx_read(self, length):
+        """Read bytes, those put back by a resync first."""
+        _bytes = bytearray(length)
+        view = memoryview(_bytes)
+        offset = 0
+        while offset < length:
+            res = self.rx_readinto(view[offset:])
+            if not res:
+                break
+            offset += res
+        del view
+        del _bytes[offset:]
+        return _bytes
+
+    def rx_readinto(self, buffer):
+        """Read into a buffer, bytes put back by a resync first."""
+        if not self.rx_pending:
+            return self.serial.readinto(buffer)
+        length = min(len(buffer), len(self.rx_pending))
+        buffer[:length] = self.rx_pending[:length]
+        del self.rx_pending[:length]
+        return length
+
+    def serve(self, path):
+        """Share the programmer with local clients over a Unix socket."""
+        try:
+            server = NandServer(self, path)
+        except OSError as err:
+            self.log.error("Can't serve on %s: %s\n", path, err)
+            return False
+        server.serve()
+        return True
+
     def show_info(self):
         """Show device info."""
         self.pkt_tx(CMD_NAND_ID_READ, None)
@@ -250,10 +544,53 @@ class NandIO:
 
         self.nand = Nand(self.log, self.pull_up)
         self.nand.identify(nand_id)
+        if TimingCache().apply(self.nand, self.programmer()):
+            self.log.info(
+                "Tuned read timing: read delay %d us, RE# delay %d nops\n",
+                self.nand.read_delay_us,
+                self.nand.re_delay_nops,
+            )
         self.pkt_tx(CMD_NAND_ID_CONFIG, self.nand.config_bytes())
 
         return True
 
-    def write(self, file):
+    def tune_timing(self):
+        """Tune read timings for the NAND and programmer."""
+        return ReadTuner(self, TimingCache()).run(self.programmer())
+
+    def erase_block(self, block, wait=True):
+        """Erase a block and return the NAND status."""
+        erase_tx = self.nand.block_erase_bytes(block, wait)
+        self.pkt_tx(CMD_NAND_BLOCK_ERASE, erase_tx)
+
+        return self.pkt_rx(CMD_NAND_BLOCK_ERASE, IONandStatusRX)
+
+    def status(self):
+        """Wait for pending NAND operations and return the NAND status."""
+        self.pkt_tx(CMD_NAND_STATUS, None)
+
+        return self.pkt_rx(CMD_NAND_STATUS, IONandStatusRX)
+
+    def write(self, file, base=None):
         """Write to device."""
-        self.log.info("NAND: write file=%s\n", file)
+        return PageWriter(self).run(file, base)
+
+    def write_page(self, page, page_bytes, cache=False):
+        """Program a single page and return the NAND status."""
+        write_tx = self.nand.page_write_bytes(page, cache)
+        self.pkt_tx(CMD_NAND_PAGE_WRITE, write_tx + page_bytes)
+
+        return self.pkt_rx(CMD_NAND_PAGE_WRITE, IONandStatusRX)
+
+    def write_status_ok(self, page, status, cache, prev_page=None):
+        """Check NAND status after a page program."""
+        # Cache program reports the previous page on FAILC
+        if prev_page is not None and status & NAND_STATUS_FAILC:
+            self.log.error("\nError programming page %d!\n", prev_page)
+            return False
+        if cache:
+            return True
+        if not status & NAND_STATUS_RDY or status & NAND_STATUS_FAIL:
+            self.log.error("\nError programming page %d!\n", page)
+            return False
+        return True
@@ -0,0 +1,91 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO read checkpoint journal."""
+
+import json
+import os
+
+from .const import JOURNAL_SUFFIX, JOURNAL_VERSION
+
+
+class ReadJournal:
+    """Read checkpoint journal.
+
+    Sidecar file next to a dump holding the chip ID and geometry followed by
+    a bitmap of the pages already verified and stored in the dump. It is
+    replaced atomically on every sync, after the dump itself has been
+    written to disk, so it never claims pages the dump doesn't have.
+    """
+
+    def __init__(self, file, nand):
+        """Init read journal."""
+        self.dump = file
+        self.file = file + JOURNAL_SUFFIX
+        self.nand = nand
+        self.bitmap = bytearray((nand.pages + 7) // 8)
+        self.marked = 0
+
+    def header(self):
+        """Journal header identifying the chip."""
+        return {
+            "version": JOURNAL_VERSION,
+            "mf_id": self.nand.mf_id,
+            "dev_id": self.nand.dev_id,
+            "page_size": self.nand.page_size,
+            "oob_size": self.nand.oob_size,
+            "block_pages": self.nand.block_pages,
+            "pages": self.nand.pages,
+        }
+
+    def load(self):
+        """Load journal, returns False if missing or not matching the NAND."""
+        if not os.path.exists(self.dump):
+            return False
+
+        try:
+            journal = open(self.file, "rb")
+        except OSError:
+            return False
+        try:
+            header = json.loads(journal.readline())
+            bitmap = journal.read()
+        except ValueError:
+            header = None
+            bitmap = b""
+        journal.close()
+
+        if header != self.header() or len(bitmap) != len(self.bitmap):
+            return False
+
+        self.bitmap[:] = bitmap
+        self.marked = 0
+        return True
+
+    def mark(self, page):
+        """Mark page as stored."""
+        self.bitmap[page >> 3] |= 1 << (page & 7)
+        self.marked += 1
+
+    def missing(self):
+        """Pages not stored yet."""
+        bitmap = self.bitmap
+        return [
+            page
+            for page in range(self.nand.pages)
+            if not bitmap[page >> 3] & (1 << (page & 7))
+        ]
+
+    def remove(self):
+        """Remove journal."""
+        if os.path.exists(self.file):
+            os.remove(self.file)
+
+    def sync(self):
+        """Write journal to disk."""
+        tmp_file = self.file + ".tmp"
+        journal = open(tmp_file, "wb")
+        journal.write(json.dumps(self.header(), sort_keys=True).encode() + b"\n")
+        journal.write(self.bitmap)
+        journal.flush()
+        os.fsync(journal.fileno())
+        journal.close()
+        os.replace(tmp_file, self.file)
@@ -0,0 +1,332 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO read metrics."""
+
+import bisect
+import json
+import os
+import threading
+import time
+
+from .common import convert_duration
+from .const import (
+    METRICS_EXPORT_INTERVAL,
+    METRICS_FORMAT_JSON,
+    METRICS_FORMAT_PROMETHEUS,
+    METRICS_LATENCY_BUCKETS,
+    METRICS_PROGRESS_INTERVAL,
+)
+
+MB = 1024 * 1024
+
+
+def device_name(serial_device):
+    """Device label of a serial device or in-process port."""
+    if isinstance(serial_device, str):
+        return serial_device
+    return type(serial_device).__name__
+
+
+class LatencyHistogram:
+    """Request latency histogram with fixed buckets in seconds."""
+
+    def __init__(self):
+        """Init latency histogram."""
+        self.buckets = METRICS_LATENCY_BUCKETS
+        self.counts = [0] * (len(self.buckets) + 1)
+        self.count = 0
+        self.sum = 0.0
+        self.max = 0.0
+
+    def observe(self, seconds):
+        """Add a latency."""
+        self.counts[bisect.bisect_left(self.buckets, seconds)] += 1
+        self.count += 1
+        self.sum += seconds
+        self.max = max(self.max, seconds)
+
+    def cumulative(self):
+        """Cumulative bucket counts, the last one is +Inf."""
+        total = 0
+        counts = []
+        for count in self.counts:
+            total += count
+            counts.append(total)
+        return counts
+
+    def quantile(self, fraction):
+        """Upper bound of the bucket holding a quantile."""
+        if not self.count:
+            return 0.0
+        rank = fraction * self.count
+        for bucket, count in zip(self.buckets, self.cumulative()):
+            if count >= rank:
+                return bucket
+        return self.max
+
+    def summary(self):
+        """Latency summary in microseconds."""
+        return {
+            "count": self.count,
+            "mean": int(self.sum * 1e6 / max(self.count, 1)),
+            "p50": int(self.quantile(0.5) * 1e6),
+            "p90": int(self.quantile(0.9) * 1e6),
+            "p99": int(self.quantile(0.99) * 1e6),
+            "max": int(self.max * 1e6),
+        }
+
+
+class DeviceMetrics:
+    """Metrics of the pipeline of a device.
+
+    Every counter is only updated by one pipeline stage.
+    """
+
+    def __init__(self, parent, name):
+        """Init device metrics."""
+        self.parent = parent
+        self.name = name
+        self.latency = LatencyHistogram()
+        self.pages = 0
+        self.retries = 0
+        self.crc_errors = 0
+        self.resyncs = 0
+
+    def request_done(self, seconds):
+        """Response of a request received."""
+        self.latency.observe(seconds)
+
+    def crc_error(self):
+        """Response failing verification."""
+        self.crc_errors += 1
+
+    def resync(self):
+        """Responses dropped after a resync."""
+        self.resyncs += 1
+
+    def retry(self):
+        """Page requested again."""
+        self.retries += 1
+
+    def stored(self):
+        """Page stored."""
+        self.pages += 1
+        self.parent.page_done()
+
+    def snapshot(self):
+        """Device metrics."""
+        return {
+            "pages": self.pages,
+            "retries": self.retries,
+            "crc_errors": self.crc_errors,
+            "resyncs": self.resyncs,
+            "latency_us": self.latency.summary(),
+        }
+
+
+class ReadMetrics:
+    """Read progress and metrics over one or more devices.
+
+    Console progress is rate limited and shows throughput and ETA. Metrics
+    can be exported periodically as JSON lines appended to a file or as a
+    Prometheus textfile, which is replaced on every export.
+    """
+
+    def __init__(
+        self, log, *, export=None, export_format=METRICS_FORMAT_JSON, progress=True
+    ):
+        """Init read metrics."""
+        self.log = log
+        self.export = export
+        self.export_format = export_format
+        self.progress = progress
+        self.lock = threading.Lock()
+        self.devices = {}
+        self.total = 0
+        self.raw_page_size = 0
+        self.done = 0
+        self.start = time.perf_counter()
+        self.last_progress = 0.0
+        self.last_export = self.start
+
+    def begin(self, total, raw_page_size):
+        """Start measuring a read of total pages."""
+        self.total = total
+        self.raw_page_size = raw_page_size
+        self.done = 0
+        self.start = time.perf_counter()
+        self.last_export = self.start
+
+    def device(self, name):
+        """Metrics of a device, created on first use."""
+        with self.lock:
+            if name not in self.devices:
+                self.devices[name] = DeviceMetrics(self, name)
+            return self.devices[name]
+
+    def elapsed(self):
+        """Seconds since the read started."""
+        return max(time.perf_counter() - self.start, 1e-6)
+
+    def page_done(self):
+        """Page stored by any device."""
+        with self.lock:
+            self.done += 1
+            now = time.perf_counter()
+            if self.progress and (
+                now - self.last_progress >= METRICS_PROGRESS_INTERVAL
+                or self.done == self.total
+            ):
+                self.last_progress = now
+                self.log_progress()
+            if self.export and now - self.last_export >= METRICS_EXPORT_INTERVAL:
+                self.last_export = now
+                self.write_export()
+
+    def eta(self):
+        """Seconds left at the average rate."""
+        if not self.done:
+            return None
+        return (self.total - self.done) * self.elapsed() / self.done
+
+    def log_progress(self):
+        """Log progress."""
+        elapsed = self.elapsed()
+        eta = self.eta()
+        self.log.info(
+            "Reading NAND %d%% (page=%d/%d, %.2f MB/s, %d pages/s, ETA %s)\r",
+            int(round(self.done * 100 / max(self.total, 1), 0)),
+            self.done,
+            self.total,
+            self.done * self.raw_page_size / elapsed / MB,
+            int(self.done / elapsed),
+            "-" if eta is None else convert_duration(eta),
+        )
+
+    def snapshot(self):
+        """Metrics of the read."""
+        elapsed = self.elapsed()
+        return {
+            "time": round(time.time(), 3),
+            "elapsed": round(elapsed, 3),
+            "pages": self.done,
+            "total": self.total,
+            "pages_per_s": round(self.done / elapsed, 1),
+            "mb_per_s": round(self.done * self.raw_page_size / elapsed / MB, 3),
+            "eta": None if self.eta() is None else round(self.eta(), 1),
+            "devices": {
+                name: device.snapshot() for name, device in self.devices.items()
+            },
+        }
+
+    def prometheus(self):
+        """Metrics in the Prometheus text format."""
+        lines = []
+
+        def metric(name, kind, text, samples):
+            lines.append("# HELP nand_io_%s %s" % (name, text))
+            lines.append("# TYPE nand_io_%s %s" % (name, kind))
+            for labels, value in samples:
+                lines.append("nand_io_%s%s %s" % (name, labels, value))
+
+        devices = [('{device="%s"}' % name, dev) for name, dev in self.devices.items()]
+        elapsed = self.elapsed()
+        metric("read_pages", "gauge", "Pages to read.", [("", self.total)])
+        metric("read_pages_done", "gauge", "Pages stored.", [("", self.done)])
+        metric(
+            "pages_per_second",
+            "gauge",
+            "Average pages stored per second.",
+            [("", round(self.done / elapsed, 1))],
+        )
+        metric("eta_seconds", "gauge", "Estimated time left.", [("", self.eta() or 0)])
+        metric(
+            "device_pages_total",
+            "counter",
+            "Pages stored by a device.",
+            [(labels, dev.pages) for labels, dev in devices],
+        )
+        metric(
+            "retries_total",
+            "counter",
+            "Pages requested again.",
+            [(labels, dev.retries) for labels, dev in devices],
+        )
+        metric(
+            "crc_errors_total",
+            "counter",
+            "Responses failing verification.",
+            [(labels, dev.crc_errors) for labels, dev in devices],
+        )
+        metric(
+            "resyncs_total",
+            "counter",
+            "Packet stream resyncs.",
+            [(labels, dev.resyncs) for labels, dev in devices],
+        )
+
+        name = "request_latency_seconds"
+        lines.append("# HELP nand_io_%s Page request latency." % name)
+        lines.append("# TYPE nand_io_%s histogram" % name)
+        for device, dev in self.devices.items():
+            hist = dev.latency
+            bounds = [str(bucket) for bucket in hist.buckets] + ["+Inf"]
+            for bound, count in zip(bounds, hist.cumulative()):
+                lines.append(
+                    'nand_io_%s_bucket{device="%s",le="%s"} %d'
+                    % (name, device, bound, count)
+                )
+            lines.append('nand_io_%s_sum{device="%s"} %f' % (name, device, hist.sum))
+            lines.append(
+                'nand_io_%s_count{device="%s"} %d' % (name, device, hist.count)
+            )
+
+        return "\n".join(lines) + "\n"
+
+    def write_export(self):
+        """Export the current metrics."""
+        try:
+            if self.export_format == METRICS_FORMAT_PROMETHEUS:
+                # Replaced atomically so collectors never see a partial file
+                tmp_path = self.export + ".tmp"
+                with open(tmp_path, "w", encoding="utf-8") as export:
+                    export.write(self.prometheus())
+                os.replace(tmp_path, self.export)
+            else:
+                with open(self.export, "a", encoding="utf-8") as export:
+                    export.write(json.dumps(self.snapshot()) + "\n")
+        except OSError as err:
+            self.log.error("\nError exporting metrics: %s\n", err)
+            self.export = None
+
+    def close(self):
+        """Log a summary and export the final metrics."""
+        with self.lock:
+            if self.progress:
+                self.log_summary()
+            if self.export:
+                self.write_export()
+
+    def log_summary(self):
+        """Log throughput and latencies of every device."""
+        elapsed = self.elapsed()
+        for name, device in self.devices.items():
+            latency = device.latency.summary()
+            self.log.info(
+                "%s: %d pages, %.2f MB/s, latency p50/p99/max %d/%d/%d us,"
+                " %d retries, %d CRC errors, %d resyncs\n",
+                name,
+                device.pages,
+                device.pages * self.raw_page_size / elapsed / MB,
+                latency["p50"],
+                latency["p99"],
+                latency["max"],
+                device.retries,
+                device.crc_errors,
+                device.resyncs,
+            )
+        self.log.info(
+            "Total: %d pages in %s, %.2f MB/s\n",
+            self.done,
+            convert_duration(elapsed),
+            self.done * self.raw_page_size / elapsed / MB,
+        )
@@ -0,0 +1,254 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO multiple device sessions."""
+
+import os
+import sys
+import threading
+
+from serial.tools import list_ports
+
+from .const import SERIAL_DEF_SPEED, SERIAL_USB_IDS
+from .interface import NandIO
+from .logger import INFO, WARNING, Logger
+from .metrics import ReadMetrics
+from .output import ReadOutput
+from .pipeline import ReadPipeline
+
+
+def discover_devices():
+    """List serial ports of connected NAND IO devices."""
+    return sorted(
+        port.device
+        for port in list_ports.comports()
+        if (port.vid, port.pid) in SERIAL_USB_IDS
+    )
+
+
+def each_file(file, index):
+    """Output file of a device when dumping different chips."""
+    root, ext = os.path.splitext(file)
+    return "%s.%d%s" % (root, index, ext)
+
+
+class PageScheduler:
+    """Page scheduler shared by several read pipelines.
+
+    Pipelines pull pages one at a time, so faster programmers take more of
+    the range.
+    """
+
+    def __init__(self, pages):
+        """Init page scheduler."""
+        self.pages = pages
+        self.lock = threading.Lock()
+        self.index = 0
+
+    def __iter__(self):
+        """Page iterator."""
+        return self
+
+    def __len__(self):
+        """Number of scheduled pages."""
+        return len(self.pages)
+
+    def __next__(self):
+        """Next page."""
+        with self.lock:
+            if self.index >= len(self.pages):
+                raise StopIteration
+            page = self.pages[self.index]
+            self.index += 1
+        return page
+
+
+class MultiNandIO:
+    """NAND IO over several devices at once."""
+
+    def __init__(
+        self,
+        serial_devices,
+        logger_level=INFO,
+        logger_stream=sys.stdout,
+        pull_up=False,
+        serial_speed=SERIAL_DEF_SPEED,
+    ):
+        """Init NAND IO sessions."""
+        self.log = Logger(level=logger_level, stream=logger_stream)
+        # Sessions only report warnings and errors, progress is aggregated
+        self.sessions = [
+            NandIO(
+                serial_device=serial_device,
+                logger_level=max(logger_level, WARNING),
+                logger_stream=logger_stream,
+                pull_up=pull_up,
+                serial_speed=serial_speed,
+            )
+            for serial_device in serial_devices
+        ]
+
+    def close(self):
+        """Close all sessions."""
+        for session in self.sessions:
+            session.close()
+
+    def open(self):
+        """Open, ping and identify the NAND of every session."""
+        for session in self.sessions:
+            if not session.open() or not session.ping() or not session.show_info():
+                self.log.error("%s: device not ready\n", session.serial_device)
+                return False
+            if not session.nand.pages:
+                self.log.error("%s: unknown NAND\n", session.serial_device)
+                return False
+
+            nand = session.nand
+            self.log.info(
+                "%s: NAND %02X:%02X, %d pages of %d bytes\n",
+                session.serial_device,
+                nand.mf_id,
+                nand.dev_id,
+                nand.pages,
+                nand.raw_page_size,
+            )
+        return True
+
+    def run_sessions(self, pipelines):
+        """Run read pipelines concurrently."""
+        results = [False] * len(pipelines)
+
+        def run(index):
+            results[index] = pipelines[index].run()
+
+        threads = [
+            threading.Thread(target=run, args=(index,), daemon=True)
+            for index in range(len(pipelines))
+        ]
+        for thread in threads:
+            thread.start()
+        try:
+            for thread in threads:
+                while thread.is_alive():
+                    thread.join(0.1)
+        except KeyboardInterrupt:
+            self.log.error("\nInterrupted!\n")
+            for pipeline in pipelines:
+                pipeline.fail(None)
+            for thread in threads:
+                thread.join()
+
+        return results
+
+    def read_each(
+        self,
+        file,
+        *,
+        votes=1,
+        metrics=None,
+        **options,
+    ):
+        """Dump a different chip on every device.
+
+        Options are the ones of ReadOutput.open().
+        """
+        pipelines = []
+        outputs = []
+        total = 0
+        for index, session in enumerate(self.sessions):
+            output = ReadOutput(session.log, session.nand)
+            output.open(each_file(file, index), **options)
+            outputs.append(output)
+            if output.pages is None:
+                total += session.nand.pages
+            else:
+                total += len(output.pages)
+
+        if metrics is None:
+            metrics = ReadMetrics(self.log)
+        metrics.begin(total, self.sessions[0].nand.raw_page_size)
+        for session, output in zip(self.sessions, outputs):
+            pipelines.append(
+                ReadPipeline(
+                    session,
+                    output,
+                    votes=votes,
+                    pages=output.pages,
+                    metrics=metrics,
+                )
+            )
+
+        results = self.run_sessions(pipelines)
+        self.log.info("\n")
+        for index, (session, output, res) in enumerate(
+            zip(self.sessions, outputs, results)
+        ):
+            if res:
+                res = session.read_recover(output)
+            res = results[index] = output.close(res)
+            self.log.info(
+                "%s: %s %s\n",
+                session.serial_device,
+                each_file(file, index),
+                "OK" if res else "FAILED",
+            )
+        metrics.close()
+
+        return all(results)
+
+    def read_split(
+        self,
+        file,
+        *,
+        votes=1,
+        metrics=None,
+        **options,
+    ):
+        """Dump one chip image split across identical devices.
+
+        Options are the ones of ReadOutput.open().
+        """
+        nand = self.sessions[0].nand
+        for session in self.sessions[1:]:
+            other = session.nand
+            if (other.mf_id, other.dev_id, other.pages, other.raw_page_size) != (
+                nand.mf_id,
+                nand.dev_id,
+                nand.pages,
+                nand.raw_page_size,
+            ):
+                self.log.error(
+                    "%s: NAND doesn't match %s\n",
+                    session.serial_device,
+                    self.sessions[0].serial_device,
+                )
+                return False
+
+        output = ReadOutput(self.log, nand)
+        output.open(file, **options)
+        pages = output.pages
+        if pages is None:
+            pages = range(nand.pages)
+
+        scheduler = PageScheduler(pages)
+        if metrics is None:
+            metrics = ReadMetrics(self.log)
+        metrics.begin(len(scheduler), nand.raw_page_size)
+        pipelines = [
+            ReadPipeline(
+                session,
+                output,
+                votes=votes,
+                pages=scheduler,
+                metrics=metrics,
+            )
+            for session in self.sessions
+        ]
+
+        results = self.run_sessions(pipelines)
+        res = all(results) and metrics.done == len(scheduler)
+        self.log.info("\n")
+        if res:
+            res = self.sessions[0].read_recover(output)
+        res = output.close(res)
+        metrics.close()
+
+        return res
@@ -6,6 +6,7 @@ from .const import (
     NAND_DEVICES,
     NAND_PAGE_ADDR_3B,
     NAND_PAGE_ADDR_4B,
+    NAND_RE_DELAY_NOPS,
     NM_BLOCK_SIZE,
     NM_BLOCK_SIZE_BASE,
     NM_BLOCK_SIZE_MASK,
@@ -14,7 +15,9 @@ from .const import (
     NM_BUS_WIDTH_BASE,
     NM_BUS_WIDTH_MASK,
     NM_BUS_WIDTH_SHIFT,
+    NM_CACHE_PROGRAM,
     NM_DEVICES,
+    NM_LAYOUT,
     NM_NAME,
     NM_OOB_SIZE,
     NM_OOB_SIZE_BASE,
@@ -34,9 +37,19 @@ from .const import (
     NM_PLANES_BASE,
     NM_PLANES_MASK,
     NM_PLANES_SHIFT,
+    NM_RE_DELAY_NOPS,
     NM_READ_DELAY_US,
 )
-from .protocol import IONandAddressTX, IONandConfigRX
+from .protocol import (
+    NAND_ERASE_NOWAIT,
+    NAND_PAGE_CACHE,
+    PAGE_ADDR_STRUCT,
+    IONandAddressTX,
+    IONandBlockEraseTX,
+    IONandConfigRX,
+    IONandPageVoteTX,
+    IONandPageWriteTX,
+)
 
 
 class Nand:
@@ -55,7 +68,9 @@ class Nand:
         self.block_size = 0
         self.blocks = 0
         self.bus_width = 0
+        self.cache_program = False
         self.dev_id = 0
+        self.layout = None
         self.mf_id = 0
         self.oob_size = 0
         self.page_addr_type = 0
@@ -66,8 +81,38 @@ class Nand:
         self.raw_block_size = 0
         self.raw_page_size = 0
         self.raw_size = 0
+        self.re_delay_nops = NAND_RE_DELAY_NOPS
         self.read_delay_us = 0
         self.size = 0
+        # Timings of the device table, before any tuning
+        self.table_re_delay_nops = NAND_RE_DELAY_NOPS
+        self.table_read_delay_us = 0
+
+    def block_config_ctypes(self, block):
+        """Block Config in ctypes format."""
+        page = block * self.block_pages
+        block_config = IONandAddressTX()
+        if self.page_addr_type == NAND_PAGE_ADDR_3B:
+            block_config.addr[0] = page & 0xFF
+            block_config.addr[1] = (page >> 8) & 0xFF
+            block_config.addr_len = 2
+        else:
+            block_config.addr[0] = page & 0xFF
+            block_config.addr[1] = (page >> 8) & 0xFF
+            block_config.addr[2] = (page >> 16) & 0xFF
+            block_config.addr_len = 3
+        return block_config
+
+    def block_erase_bytes(self, block, wait=True):
+        """Block Erase in byte array format."""
+        return bytearray(self.block_erase_ctypes(block, wait))
+
+    def block_erase_ctypes(self, block, wait=True):
+        """Block Erase in ctypes format."""
+        return IONandBlockEraseTX(
+            addr=self.block_config_ctypes(block),
+            flags=0 if wait else NAND_ERASE_NOWAIT,
+        )
 
     def config_bytes(self):
         """NAND Config in byte array format."""
@@ -79,10 +124,14 @@ class Nand:
             raw_page_size=self.raw_page_size,
             read_delay_us=self.read_delay_us,
             pull_up=self.pull_up,
+            re_delay_nops=self.re_delay_nops,
         )
 
     def identify(self, nand_id):
         """Attempt to idenfify NAND device."""
+        self.mf_id = nand_id.mf_id
+        self.dev_id = nand_id.dev_id
+
         nand_mf = None
         nand_dev = None
         if nand_id.mf_id in NAND_DEVICES:
@@ -116,6 +165,18 @@ class Nand:
         if NM_READ_DELAY_US in nand_dev:
             self.read_delay_us = nand_dev[NM_READ_DELAY_US]
 
+        if NM_RE_DELAY_NOPS in nand_dev:
+            self.re_delay_nops = nand_dev[NM_RE_DELAY_NOPS]
+
+        self.table_read_delay_us = self.read_delay_us
+        self.table_re_delay_nops = self.re_delay_nops
+
+        if NM_CACHE_PROGRAM in nand_dev:
+            self.cache_program = nand_dev[NM_CACHE_PROGRAM]
+
+        if NM_LAYOUT in nand_dev:
+            self.layout = nand_dev[NM_LAYOUT]
+
         if NM_PAGE_ADDR_TYPE in nand_dev:
             self.page_addr_type = nand_dev[NM_PAGE_ADDR_TYPE]
 
@@ -191,6 +252,7 @@ class Nand:
         self.log.info("\tNumber of blocks: %d\n", self.blocks)
         self.log.info("\tNumber of pages: %d\n", self.pages)
         self.log.info("\tPages per block: %d\n", self.block_pages)
+        self.log.info("\tCache program: %s\n", "yes" if self.cache_program else "no")
 
         return True
 
@@ -220,3 +282,35 @@ class Nand:
             page_config.addr[4] = (page >> 16) & 0xFF
             page_config.addr_len = 5
         return page_config
+
+    def page_config_into(self, buffer, page):
+        """Page Config packed into an existing buffer."""
+        if self.page_addr_type == NAND_PAGE_ADDR_3B:
+            addr = (0, page & 0xFF, (page >> 8) & 0xFF, 0, 0, 3)
+        elif self.page_addr_type == NAND_PAGE_ADDR_4B:
+            addr = (0, page & 0xFF, (page >> 8) & 0xFF, (page >> 16) & 0xFF, 0, 4)
+        else:
+            addr = (0, 0, page & 0xFF, (page >> 8) & 0xFF, (page >> 16) & 0xFF, 5)
+        PAGE_ADDR_STRUCT.pack_into(buffer, 0, *addr)
+
+    def page_vote_bytes(self, page, reads):
+        """Page Vote in byte array format."""
+        return bytearray(self.page_vote_ctypes(page, reads))
+
+    def page_vote_ctypes(self, page, reads):
+        """Page Vote in ctypes format."""
+        return IONandPageVoteTX(
+            addr=self.page_config_ctypes(page),
+            reads=reads,
+        )
+
+    def page_write_bytes(self, page, cache=False):
+        """Page Write in byte array format."""
+        return bytearray(self.page_write_ctypes(page, cache))
+
+    def page_write_ctypes(self, page, cache=False):
+        """Page Write in ctypes format."""
+        return IONandPageWriteTX(
+            addr=self.page_config_ctypes(page),
+            flags=NAND_PAGE_CACHE if cache else 0,
+        )
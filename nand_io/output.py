@@ -0,0 +1,229 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO read output."""
+
+import os
+import threading
+
+from .badblock import LogicalImage
+from .compress import CompressedWriter, codec_select
+from .const import CONTAINER_BLANK, ECC_REPORT_SUFFIX, JOURNAL_SYNC_PAGES
+from .container import Container, container_create, is_container
+from .ecc import EccEngine, EccStats, default_layout
+from .image import BlankMap
+from .journal import ReadJournal
+from .store import StoreWriter
+
+
+class ReadOutput:
+    """Read output.
+
+    Raw dump or container together with its read journal and blank page
+    bitmap, or a compressed dump or page store manifest, which can't be
+    resumed. Bit flips of ECC corrected pages are listed in a report, and
+    pages still uncorrectable when re-read keep their first copy. The page
+    data of good blocks may also go to a logical image. Pages may be stored
+    by several read pipelines at once.
+    """
+
+    def __init__(self, log, nand):
+        """Init read output."""
+        self.log = log
+        self.nand = nand
+        self.lock = threading.Lock()
+        self.out = None
+        self.store = None
+        self.compressed = None
+        self.page_store = None
+        self.journal = None
+        self.blank_map = None
+        self.bad_blocks = None
+        self.logical = None
+        self.ecc = None
+        self.ecc_stats = None
+        self.pages = None
+
+    def open(
+        self,
+        file,
+        *,
+        resume=False,
+        sparse=False,
+        container=False,
+        ecc=False,
+        compress=None,
+        store=None,
+    ):
+        """Open read output, pages is set to the pages left when resuming."""
+        if (compress or store) and resume:
+            self.log.warning("Only raw dumps can be resumed, reading all pages\n")
+        if store:
+            self.pages = None
+            self.page_store = StoreWriter(file, self.nand, store)
+            self.log.info("Page store: %s\n", store)
+        elif compress:
+            self.open_compressed(file, codec_select(compress))
+        else:
+            self.open_dump(file, resume, sparse, container)
+
+        if ecc:
+            layout = self.nand.layout or default_layout(
+                self.nand.page_size, self.nand.oob_size
+            )
+            self.ecc = EccEngine(layout, self.nand.page_size, self.nand.oob_size)
+            self.ecc_stats = EccStats()
+            # Pages of an interrupted read are already in the report
+            self.ecc_stats.open_report(
+                file + ECC_REPORT_SUFFIX, append=self.pages is not None
+            )
+            self.log.info("ECC correction: %s\n", self.ecc.describe())
+
+    def open_logical(self, file, bad_blocks, resume=False):
+        """Open a logical image of the good blocks."""
+        self.bad_blocks = bad_blocks
+        self.logical = LogicalImage(file, self.nand, bad_blocks, resume)
+        self.log.info("Logical image: %s\n", file)
+
+    def open_compressed(self, file, codec):
+        """Open a compressed dump."""
+        self.pages = None
+        self.compressed = CompressedWriter(file, self.nand, codec)
+        self.log.info("Compression: %s\n", codec)
+
+    def open_dump(self, file, resume, sparse, container):
+        """Open a raw dump or container and its journal."""
+        self.journal = ReadJournal(file, self.nand)
+        self.blank_map = BlankMap(file, self.nand.pages, self.nand.raw_page_size)
+        self.pages = None
+        if resume and self.journal.load():
+            self.pages = self.journal.missing()
+            self.log.info(
+                "Resuming read: %d of %d pages left\n",
+                len(self.pages),
+                self.nand.pages,
+            )
+            container = is_container(file)
+            # Blank pages already skipped have to stay in the bitmap
+            sparse = self.blank_map.load() or sparse
+        else:
+            if resume:
+                self.log.warning(
+                    "No matching journal for %s, reading all pages\n", file
+                )
+            self.blank_map.remove()
+
+        if container:
+            if self.pages is None:
+                self.store = container_create(file, self.nand)
+            else:
+                self.store = Container(file, writable=True)
+            # Containers flag blank pages in their index
+            sparse = False
+        elif self.pages is None:
+            self.out = open(file, "wb")
+        else:
+            self.out = open(file, "r+b")
+        if not sparse:
+            self.blank_map = None
+
+    def close(self, res):
+        """Close read output, returns the read result.
+
+        The read fails if the compressed dump can't be completed.
+        """
+        if self.journal and not res:
+            # Pages have to be on disk before the journal checkpoints them
+            self.sync()
+
+        if self.page_store:
+            self.page_store.close(res)
+            self.page_store.log_summary(self.log)
+            if not res:
+                self.log.error("Read incomplete, manifest marked incomplete\n")
+        elif self.compressed:
+            try:
+                self.compressed.close(res)
+            except OSError as err:
+                self.log.error("%s\n", err)
+                res = False
+            self.compressed.log_summary(self.log)
+            if not res:
+                self.log.error("Read incomplete, compressed dump left unindexed\n")
+        elif self.store:
+            self.store.close()
+        elif self.out:
+            if res and self.blank_map:
+                # Trailing blank pages are a hole too
+                self.out.truncate(self.nand.pages * self.nand.raw_page_size)
+            self.out.close()
+
+        if self.logical:
+            self.logical.close()
+            self.log.info(
+                "Logical image: %d good blocks, %d bad and %d reserved skipped\n",
+                self.bad_blocks.good,
+                len(self.bad_blocks.bad),
+                len(self.bad_blocks.reserved),
+            )
+        if self.blank_map:
+            self.blank_map.sync()
+            blank_pages = sum(
+                1 for page in range(self.nand.pages) if self.blank_map.is_blank(page)
+            )
+            self.log.info("Blank pages: %d (not written)\n", blank_pages)
+        if self.ecc_stats:
+            self.ecc_stats.close()
+            self.ecc_stats.log_summary(self.log)
+        if self.journal:
+            if res:
+                self.journal.remove()
+            else:
+                self.log.error("Read incomplete, continue it with --resume\n")
+
+        return res
+
+    def store_page(self, page, data, flags=0, flips=None):
+        """Store a raw page, flips being its ECC result."""
+        if flips is not None and not self.ecc_stats.add(page, flips):
+            return
+
+        with self.lock:
+            if self.page_store:
+                self.page_store.store_page(page, data)
+            elif self.compressed:
+                # Uncorrectable pages may still be replaced by a re-read
+                self.compressed.store_page(
+                    page,
+                    data,
+                    hold=flips is not None and page in self.ecc_stats.uncorrectable,
+                )
+            elif self.store:
+                self.store.write_page(page, data, flags)
+            elif self.blank_map and flags & CONTAINER_BLANK:
+                # Leave a hole in the output file
+                self.blank_map.mark(page)
+            else:
+                self.out.seek(page * self.nand.raw_page_size)
+                self.out.write(data)
+            if self.logical:
+                self.logical.store_page(page, data)
+
+            if self.journal:
+                self.journal.mark(page)
+                if self.journal.marked % JOURNAL_SYNC_PAGES == 0:
+                    self.sync()
+
+    def sync(self):
+        """Write stored pages to disk and checkpoint them in the journal."""
+        if self.store:
+            # Container pages are mapped, flushing them is a synchronous msync
+            self.store.flush()
+        else:
+            self.out.flush()
+            os.fsync(self.out.fileno())
+        if self.logical:
+            self.logical.flush()
+        if self.blank_map:
+            self.blank_map.sync()
+        if self.ecc_stats:
+            self.ecc_stats.sync()
+        self.journal.sync()
@@ -0,0 +1,379 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO read pipeline."""
+
+import collections
+import ctypes
+import queue
+import struct
+import threading
+import time
+
+from .const import (
+    CONTAINER_BLANK,
+    CONTAINER_UNSTABLE,
+    PAGE_RW_RETRIES,
+    PIPELINE_BUFFERS,
+    PIPELINE_WINDOW,
+)
+from .metrics import ReadMetrics, device_name
+from .protocol import (
+    CMD_NAND_PAGE_READ,
+    CMD_NAND_PAGE_READ_VOTE,
+    IOCrc16,
+    IOCrc32,
+    IONandAddressTX,
+    IONandPageVoteTX,
+    IONandVoteRX,
+    IOPacketHeader,
+)
+
+PKT_DATA_OFFSET = ctypes.sizeof(IOPacketHeader) + ctypes.sizeof(IOCrc16)
+PKT_OVERHEAD = PKT_DATA_OFFSET + ctypes.sizeof(IOCrc32)
+
+VOTE_STRUCT = struct.Struct("<I")
+
+
+class PipelineStage:
+    """Pipeline stage utilisation."""
+
+    def __init__(self, name):
+        """Init pipeline stage."""
+        self.name = name
+        self.busy = 0.0
+        self.items = 0
+        self.start = 0.0
+
+    def begin(self):
+        """Start of work on an item."""
+        self.start = time.perf_counter()
+
+    def end(self):
+        """End of work on an item."""
+        self.busy += time.perf_counter() - self.start
+        self.items += 1
+
+
+class ReadPipeline:
+    """Pipelined NAND reader.
+
+    A receive thread keeps requests in flight and drains the serial device
+    into preallocated buffers, a verify thread checks packet CRCs and corrects
+    pages when the output has an ECC engine, and a writer thread hands pages
+    to the read output. Bounded queues and the buffer pool apply backpressure,
+    and pages failing verification are requested again by the receive thread.
+    If the stream loses sync, the responses in flight are dropped up to a ping
+    and their pages requested again.
+    Pages are taken from any iterable, which may be shared by several
+    pipelines.
+    """
+
+    def __init__(
+        self,
+        nand_io,
+        output,
+        *,
+        votes=1,
+        pages=None,
+        metrics=None,
+        report=True,
+        buffers=PIPELINE_BUFFERS,
+        window=PIPELINE_WINDOW,
+    ):
+        """Init read pipeline."""
+        self.nand_io = nand_io
+        self.log = nand_io.log
+        self.nand = nand_io.nand
+        self.output = output
+        self.ecc = output.ecc
+        if pages is None:
+            pages = range(self.nand.pages)
+        self.total = len(pages)
+        self.source = iter(pages)
+        if metrics is None:
+            metrics = ReadMetrics(self.log)
+            metrics.begin(self.total, self.nand.raw_page_size)
+        self.metrics = metrics.device(device_name(nand_io.serial_device))
+        self.votes = votes
+        self.report = report
+        self.window = window
+
+        if votes > 1:
+            self.cmd = CMD_NAND_PAGE_READ_VOTE
+            self.data_len = self.nand.raw_page_size + ctypes.sizeof(IONandVoteRX)
+            self.request_tx = bytearray(ctypes.sizeof(IONandPageVoteTX))
+            self.request_tx[-1] = votes
+        else:
+            self.cmd = CMD_NAND_PAGE_READ
+            self.data_len = self.nand.raw_page_size
+            self.request_tx = bytearray(ctypes.sizeof(IONandAddressTX))
+        self.pkt_len = self.data_len + PKT_OVERHEAD
+        self.hdr = (self.cmd, self.data_len)
+
+        self.free = queue.Queue()
+        for _ in range(buffers):
+            self.free.put(bytearray(self.pkt_len))
+        self.verify_queue = queue.Queue(buffers)
+        self.write_queue = queue.Queue(buffers)
+        self.retry_queue = queue.Queue()
+
+        self.done = threading.Event()
+        self.stop = threading.Event()
+        self.error = None
+        self.retries = {}
+        self.resyncs_in_row = 0
+        self.exhausted = False
+        self.requested = 0
+        self.written = 0
+        self.unstable_pages = 0
+        self.unstable_bits = 0
+
+        self.stages = [
+            PipelineStage("receive"),
+            PipelineStage("verify"),
+            PipelineStage("write"),
+        ]
+
+    def fail(self, error):
+        """Abort the pipeline."""
+        if self.error is None:
+            self.error = error
+        self.stop.set()
+
+    def finished(self):
+        """Check if all pages have been stored."""
+        return self.exhausted and self.written == self.requested
+
+    def next_page(self):
+        """Next page to request, retries first."""
+        try:
+            return self.retry_queue.get_nowait()
+        except queue.Empty:
+            pass
+        if self.exhausted:
+            return None
+        page = next(self.source, None)
+        if page is None:
+            self.exhausted = True
+        else:
+            self.requested += 1
+        return page
+
+    def request(self, page):
+        """Send a page read request."""
+        self.nand.page_config_into(self.request_tx, page)
+        self.nand_io.pkt_tx(self.cmd, self.request_tx)
+
+    def retry(self, page):
+        """Request a page again until it runs out of retries."""
+        retries = self.retries.get(page, PAGE_RW_RETRIES) - 1
+        self.retries[page] = retries
+        self.metrics.retry()
+        self.log.error("\nError reading page %d! (%d retries left)\n", page, retries)
+        if retries == 0:
+            self.fail(None)
+        else:
+            self.retry_queue.put(page)
+
+    def resync(self, page, inflight, hdr):
+        """Drop the responses in flight after an unexpected packet."""
+        self.log.warning(
+            "\nPage %d: packet sync lost, %d responses dropped\n",
+            page,
+            len(inflight) + 1,
+        )
+        self.metrics.resync()
+        self.resyncs_in_row += 1
+        if self.resyncs_in_row > PAGE_RW_RETRIES or not self.nand_io.pkt_barrier(hdr):
+            raise IOError("packet sync lost")
+
+        # The pages weren't at fault, their retries are kept
+        self.retry_queue.put(page)
+        while inflight:
+            self.retry_queue.put(inflight.popleft()[0])
+
+    def receive_into(self, view):
+        """Receive a whole packet, returns the number of bytes read."""
+        length = 0
+        while length < len(view):
+            res = self.nand_io.rx_readinto(view[length:])
+            if not res:
+                break
+            length += res
+        return length
+
+    def receive(self):
+        """Receive stage."""
+        stage = self.stages[0]
+        inflight = collections.deque()
+        try:
+            while not self.stop.is_set():
+                while len(inflight) < self.window:
+                    page = self.next_page()
+                    if page is None:
+                        break
+                    self.request(page)
+                    inflight.append((page, time.perf_counter()))
+
+                if not inflight:
+                    if self.finished() or self.done.wait(0.01):
+                        break
+                    continue
+
+                page, sent = inflight.popleft()
+                buffer = self.free.get()
+                view = memoryview(buffer)
+                stage.begin()
+                resyncs = self.nand_io.rx_resyncs
+                hdr = self.nand_io.pkt_rx_header(view[:PKT_DATA_OFFSET])
+                # After a resync the packet may belong to a later page
+                if hdr != self.hdr or resyncs != self.nand_io.rx_resyncs:
+                    stage.end()
+                    self.free.put(buffer)
+                    self.resync(page, inflight, hdr)
+                    continue
+                self.resyncs_in_row = 0
+                length = PKT_DATA_OFFSET
+                length += self.receive_into(view[PKT_DATA_OFFSET:])
+                stage.end()
+                self.metrics.request_done(time.perf_counter() - sent)
+                self.verify_queue.put((page, buffer, length))
+        except Exception as err:  # pylint: disable=broad-except
+            self.fail(err)
+        self.verify_queue.put(None)
+
+    def verify(self):
+        """Verify stage."""
+        stage = self.stages[1]
+        raw_page_size = self.nand.raw_page_size
+        blank_bytes = b"\xff" * raw_page_size
+        while True:
+            item = self.verify_queue.get()
+            if item is None:
+                break
+            page, buffer, length = item
+
+            stage.begin()
+            flags = 0
+            flips = None
+            ok = length == self.pkt_len and self.nand_io.pkt_check(
+                self.cmd, buffer, self.data_len
+            )
+            if ok and self.votes > 1:
+                (unstable_bits,) = VOTE_STRUCT.unpack_from(
+                    buffer, PKT_DATA_OFFSET + raw_page_size
+                )
+                if unstable_bits:
+                    flags |= CONTAINER_UNSTABLE
+                    self.unstable_pages += 1
+                    self.unstable_bits += unstable_bits
+                    self.log.warning(
+                        "\nPage %d: %d unstable bits\n", page, unstable_bits
+                    )
+            if ok and buffer.startswith(blank_bytes, PKT_DATA_OFFSET):
+                flags |= CONTAINER_BLANK
+            if ok and self.ecc:
+                if flags & CONTAINER_BLANK:
+                    flips = 0
+                else:
+                    flips = self.ecc.correct(
+                        memoryview(buffer)[
+                            PKT_DATA_OFFSET : PKT_DATA_OFFSET + raw_page_size
+                        ]
+                    )
+            stage.end()
+
+            if ok:
+                self.write_queue.put((page, buffer, flags, flips))
+                continue
+
+            self.free.put(buffer)
+            self.metrics.crc_error()
+            self.retry(page)
+        self.write_queue.put(None)
+
+    def write(self):
+        """Write stage."""
+        stage = self.stages[2]
+        raw_page_size = self.nand.raw_page_size
+        while True:
+            item = self.write_queue.get()
+            if item is None:
+                break
+            page, buffer, flags, flips = item
+
+            stage.begin()
+            try:
+                self.output.store_page(
+                    page,
+                    memoryview(buffer)[
+                        PKT_DATA_OFFSET : PKT_DATA_OFFSET + raw_page_size
+                    ],
+                    flags,
+                    flips,
+                )
+            except OSError as err:
+                self.fail(err)
+            stage.end()
+            self.free.put(buffer)
+
+            self.written += 1
+            self.metrics.stored()
+            if self.finished():
+                self.done.set()
+
+    def run(self):
+        """Run the pipeline until all pages are stored."""
+        start = time.perf_counter()
+        rx_resyncs = self.nand_io.rx_resyncs
+        rx_dropped = self.nand_io.rx_dropped
+        threads = [
+            threading.Thread(target=self.receive, daemon=True),
+            threading.Thread(target=self.verify, daemon=True),
+            threading.Thread(target=self.write, daemon=True),
+        ]
+        for thread in threads:
+            thread.start()
+        try:
+            for thread in threads:
+                thread.join()
+        except KeyboardInterrupt:
+            # Let the stages drain so stored pages are kept
+            self.log.error("\nInterrupted!\n")
+            self.fail(None)
+            for thread in threads:
+                thread.join()
+        elapsed = time.perf_counter() - start
+
+        if self.report:
+            self.log.info("\n")
+            if self.votes > 1:
+                self.log.info(
+                    "Unstable pages: %d (%d bits)\n",
+                    self.unstable_pages,
+                    self.unstable_bits,
+                )
+            if self.nand_io.rx_resyncs != rx_resyncs:
+                self.log.info(
+                    "Stream resyncs: %d (%d bytes dropped)\n",
+                    self.nand_io.rx_resyncs - rx_resyncs,
+                    self.nand_io.rx_dropped - rx_dropped,
+                )
+            self.log_stages(elapsed)
+
+        if self.error is not None:
+            self.log.error("Read error: %s\n", self.error)
+
+        return self.error is None and self.finished()
+
+    def log_stages(self, elapsed):
+        """Log per stage utilisation."""
+        if elapsed <= 0:
+            return
+        self.log.info("Pipeline utilisation:\n")
+        for stage in self.stages:
+            self.log.info(
+                "\t%s: %d%% (%d pages)\n",
+                stage.name,
+                int(round(stage.busy * 100 / elapsed, 0)),
+                stage.items,
+            )
@@ -2,6 +2,9 @@
 """NAND IO protocol."""
 
 import ctypes
+import struct
+
+from .crc import CRC32_START, crc32
 
 # Device
 CMD_PING = 0x10
@@ -13,6 +16,8 @@ CMD_NAND_ID_CONFIG = 0x31
 CMD_NAND_PAGE_READ = 0x32
 CMD_NAND_PAGE_WRITE = 0x33
 CMD_NAND_BLOCK_ERASE = 0x34
+CMD_NAND_PAGE_READ_VOTE = 0x35
+CMD_NAND_STATUS = 0x36
 # Error
 CMD_ERROR = 0xF0
 
@@ -25,10 +30,56 @@ CMD_ERROR_NOT_SUPPORTED = 4
 
 # Protocol Magic
 PKT_MAGIC = 0xDEADC0DE
+PKT_MAGIC_BYTES = PKT_MAGIC.to_bytes(4, "little")
+
+# Page write flags
+NAND_PAGE_CACHE = 0x01
+
+# Page read votes
+NAND_VOTE_MAX_READS = 7
+
+# Block erase flags
+NAND_ERASE_NOWAIT = 0x01
+
+# Status flags
+NAND_STATUS_ERASE_FAIL = 0x01
 
 # Page address size
 PAGE_ADDR_SIZE = 5
 
+# Precompiled codecs
+PKT_HDR_STRUCT = struct.Struct("<IHI")
+PKT_CRC16_STRUCT = struct.Struct("<H")
+PKT_CRC32_STRUCT = struct.Struct("<I")
+PAGE_ADDR_STRUCT = struct.Struct("<%dBB" % PAGE_ADDR_SIZE)
+
+# Header with its CRC
+PKT_HDR_LEN = PKT_HDR_STRUCT.size + PKT_CRC16_STRUCT.size
+
+
+def pkt_sync_offset(_bytes):
+    """Offset of the next possible packet start after the first byte."""
+    offset = _bytes.find(PKT_MAGIC_BYTES, 1)
+    if offset >= 0:
+        return offset
+
+    # Magic cut short at the end
+    for offset in range(max(len(_bytes) - len(PKT_MAGIC_BYTES) + 1, 1), len(_bytes)):
+        if PKT_MAGIC_BYTES.startswith(_bytes[offset:]):
+            return offset
+
+    return len(_bytes)
+
+
+def pkt_data_ok(_bytes, data_len):
+    """Check packet data followed by its CRC."""
+    if not data_len:
+        return True
+    if len(_bytes) != data_len + PKT_CRC32_STRUCT.size:
+        return False
+    (data_crc,) = PKT_CRC32_STRUCT.unpack_from(_bytes, data_len)
+    return crc32(CRC32_START, _bytes, data_len) == data_crc
+
 
 class IOBootloaderRX(ctypes.LittleEndianStructure):
     """Enter device bootloader (response)."""
@@ -86,6 +137,7 @@ class IOPingRX(ctypes.LittleEndianStructure):
         ("version", ctypes.c_uint16),
         ("serial_speed", ctypes.c_uint32),
         ("memory_free", ctypes.c_uint32),
+        ("resyncs", ctypes.c_uint32),
     ]
 
 
@@ -108,6 +160,16 @@ class IONandAddressTX(ctypes.LittleEndianStructure):
     ]
 
 
+class IONandBlockEraseTX(ctypes.LittleEndianStructure):
+    """NAND block erase (request)."""
+
+    _pack_ = 1
+    _fields_ = [
+        ("addr", IONandAddressTX),
+        ("flags", ctypes.c_uint8),
+    ]
+
+
 class IONandConfigRX(ctypes.LittleEndianStructure):
     """NAND configuration (request)."""
 
@@ -116,6 +178,7 @@ class IONandConfigRX(ctypes.LittleEndianStructure):
         ("raw_page_size", ctypes.c_uint32),
         ("read_delay_us", ctypes.c_uint32),
         ("pull_up", ctypes.c_uint8),
+        ("re_delay_nops", ctypes.c_uint8),
     ]
 
 
@@ -130,3 +193,42 @@ class IONandIdRX(ctypes.LittleEndianStructure):
         ("size_data", ctypes.c_uint8),
         ("plane_data", ctypes.c_uint8),
     ]
+
+
+class IONandPageWriteTX(ctypes.LittleEndianStructure):
+    """NAND page write (request)."""
+
+    _pack_ = 1
+    _fields_ = [
+        ("addr", IONandAddressTX),
+        ("flags", ctypes.c_uint8),
+    ]
+
+
+class IONandStatusRX(ctypes.LittleEndianStructure):
+    """NAND status (response)."""
+
+    _pack_ = 1
+    _fields_ = [
+        ("status", ctypes.c_uint8),
+        ("flags", ctypes.c_uint8),
+    ]
+
+
+class IONandPageVoteTX(ctypes.LittleEndianStructure):
+    """NAND page majority vote read (request)."""
+
+    _pack_ = 1
+    _fields_ = [
+        ("addr", IONandAddressTX),
+        ("reads", ctypes.c_uint8),
+    ]
+
+
+class IONandVoteRX(ctypes.LittleEndianStructure):
+    """NAND page majority vote read trailer (response)."""
+
+    _pack_ = 1
+    _fields_ = [
+        ("unstable_bits", ctypes.c_uint32),
+    ]
@@ -24,8 +24,14 @@ class SerialDevice:
         self.timeout = timeout
 
         self.buffer_size = SERIAL_BUFFER_SIZE
-        self.buffer = bytearray()
-        self.serial = serial.Serial(self.device, self.speed, timeout=self.timeout)
+        self.buffer = bytearray(self.buffer_size)
+        self.buffer_view = memoryview(self.buffer)
+        self.buffer_len = 0
+        if isinstance(device, str):
+            self.serial = serial.Serial(self.device, self.speed, timeout=self.timeout)
+        else:
+            # Already open port object, such as an in-process transport
+            self.serial = device
 
     def close(self):
         """Close serial device."""
@@ -36,10 +42,10 @@ class SerialDevice:
 
     def flush(self):
         """Flush serial device."""
-        if len(self.buffer) > 0:
-            self.serial.write(self.buffer)
+        if self.buffer_len > 0:
+            self.serial.write(self.buffer_view[: self.buffer_len])
             self.serial.flush()
-            self.buffer = bytearray()
+            self.buffer_len = 0
             return True
         return False
 
@@ -55,9 +61,18 @@ class SerialDevice:
             _bytes = self.serial.read(arg)
         return _bytes
 
+    def readinto(self, buffer):
+        """Read from serial device into a buffer."""
+        self.flush()
+        return self.serial.readinto(buffer)
+
     def write(self, arg):
         """Write to serial device."""
-        self.buffer += bytearray(arg)
-        while len(self.buffer) > self.buffer_size:
-            self.serial.write(self.buffer[: self.buffer_size])
-            self.buffer_size = self.buffer_size[self.buffer_size :]
+        data = memoryview(arg).cast("B")
+        if self.buffer_len + len(data) > self.buffer_size:
+            self.flush()
+            if len(data) > self.buffer_size:
+                self.serial.write(data)
+                return
+        self.buffer_view[self.buffer_len : self.buffer_len + len(data)] = data
+        self.buffer_len += len(data)
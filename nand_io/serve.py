@@ -0,0 +1,390 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO programmer sharing daemon."""
+
+import json
+import os
+import queue
+import signal
+import socket
+import socketserver
+import stat
+import threading
+
+from .const import (
+    NAND_STATUS_FAIL,
+    NAND_STATUS_RDY,
+    SERVE_CACHE_PAGES,
+    SERVE_OP_ERASE,
+    SERVE_OP_INFO,
+    SERVE_OP_PROGRAM,
+    SERVE_OP_READ,
+    SERVE_OP_STATS,
+    SERVE_READ_MAX_PAGES,
+)
+from .file import PageCache
+
+
+class ServeRequest:
+    """Client request waiting for the device."""
+
+    def __init__(self, op, args, data=None):
+        """Init serve request."""
+        self.op = op
+        self.args = args
+        self.data = data
+        self.reply = None
+        self.reply_data = b""
+        self.done = threading.Event()
+
+    def finish(self, reply, reply_data=b""):
+        """Answer the request."""
+        self.reply = reply
+        self.reply_data = reply_data
+        self.done.set()
+
+
+class ServeHandler(socketserver.StreamRequestHandler):
+    """Client connection.
+
+    Every request is a JSON line, followed by "length" bytes of page data
+    for programs. Every reply is a JSON line, followed by "length" bytes of
+    raw pages for reads.
+    """
+
+    def handle(self):
+        """Serve requests until the client disconnects."""
+        server = self.server
+        while True:
+            line = self.rfile.readline()
+            if not line:
+                break
+            try:
+                args = json.loads(line)
+                op = args["op"]
+                data = None
+                if op == SERVE_OP_PROGRAM:
+                    length = int(args["length"])
+                    if not 0 <= length <= server.nand.raw_page_size:
+                        # The page data can't be skipped to reach the next line
+                        self.send({"ok": False, "error": "bad request: length"})
+                        break
+                    data = self.rfile.read(length)
+            except (KeyError, TypeError, ValueError) as err:
+                self.send({"ok": False, "error": "bad request: %s" % err})
+                continue
+            # A client gone in the middle of a program must not write a page
+            if data is not None and len(data) != length:
+                try:
+                    self.send({"ok": False, "error": "truncated page data"})
+                except OSError:
+                    pass
+                break
+
+            if op == SERVE_OP_INFO:
+                self.send(dict(server.info, ok=True))
+                continue
+
+            request = ServeRequest(op, args, data)
+            server.requests.put(request)
+            request.done.wait()
+            self.send(request.reply, request.reply_data)
+
+    def send(self, reply, reply_data=b""):
+        """Send a reply."""
+        if reply_data:
+            reply["length"] = len(reply_data)
+        self.wfile.write(json.dumps(reply).encode() + b"\n")
+        if reply_data:
+            self.wfile.write(reply_data)
+        self.wfile.flush()
+
+
+class NandServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    """Programmer shared over a Unix socket.
+
+    Only the device thread talks to the programmer. It takes every request
+    queued while the previous batch was running and splits them at programs
+    and erases, which run in arrival order. Reads between them are merged:
+    the pages missing from the cache are sorted by address and read as
+    contiguous pipelined runs, so overlapping and adjacent reads from
+    several clients cost one pass over the NAND. Programs and erases drop
+    the pages they change from the cache.
+    """
+
+    daemon_threads = True
+
+    def __init__(self, nand_io, path, *, cache_pages=SERVE_CACHE_PAGES):
+        """Init NAND server."""
+        self.nand_io = nand_io
+        self.log = nand_io.log
+        self.nand = nand_io.nand
+        self.cache = PageCache(cache_pages)
+        self.requests = queue.Queue()
+        self.info = {
+            "id": "%02x%02x" % (self.nand.mf_id, self.nand.dev_id),
+            "pages": self.nand.pages,
+            "page_size": self.nand.page_size,
+            "oob_size": self.nand.oob_size,
+            "raw_page_size": self.nand.raw_page_size,
+            "block_pages": self.nand.block_pages,
+        }
+        self.stats = {
+            "requests": 0,
+            "batches": 0,
+            "pages_read": 0,
+            "runs": 0,
+        }
+
+        remove_stale_socket(path)
+        super().__init__(path, ServeHandler)
+        self.worker = threading.Thread(target=self.work, daemon=True)
+
+    def serve(self):
+        """Serve clients until interrupted."""
+        self.log.info("Serving NAND on %s\n", self.server_address)
+        # Daemons are stopped with SIGTERM, clean up as on Ctrl+C
+        if threading.current_thread() is threading.main_thread():
+            signal.signal(signal.SIGTERM, signal.default_int_handler)
+        self.worker.start()
+        try:
+            self.serve_forever()
+        except KeyboardInterrupt:
+            self.log.info("\n")
+        finally:
+            self.requests.put(None)
+            self.worker.join()
+            self.server_close()
+            os.remove(self.server_address)
+
+    def work(self):
+        """Run queued requests on the device."""
+        while True:
+            batch = [self.requests.get()]
+            while True:
+                try:
+                    batch.append(self.requests.get_nowait())
+                except queue.Empty:
+                    break
+            if None in batch:
+                for request in batch:
+                    if request is not None:
+                        request.finish({"ok": False, "error": "server stopped"})
+                return
+
+            self.stats["requests"] += len(batch)
+            self.stats["batches"] += 1
+            reads = []
+            for request in batch:
+                if request.op == SERVE_OP_READ:
+                    reads.append(request)
+                    continue
+                self.run_reads(reads)
+                reads = []
+                self.run(request)
+            self.run_reads(reads)
+
+    def run(self, request):
+        """Run a request other than a read."""
+        try:
+            self.run_op(request)
+        except Exception as err:  # pylint: disable=broad-except
+            # The device thread has to keep serving the other clients
+            self.log.error("Error running %s request: %s\n", request.op, err)
+            if not request.done.is_set():
+                request.finish({"ok": False, "error": str(err)})
+
+    def run_op(self, request):
+        """Run an erase, program or stats request."""
+        try:
+            if request.op == SERVE_OP_ERASE:
+                request.finish(self.erase(int(request.args["block"])))
+            elif request.op == SERVE_OP_PROGRAM:
+                request.finish(self.program(int(request.args["page"]), request.data))
+            elif request.op == SERVE_OP_STATS:
+                stats = dict(self.stats, ok=True)
+                stats["cache_pages"] = len(self.cache)
+                stats["cache_hits"] = self.cache.hits
+                stats["cache_misses"] = self.cache.misses
+                request.finish(stats)
+            else:
+                request.finish({"ok": False, "error": "unknown op %s" % request.op})
+        except (KeyError, TypeError, ValueError) as err:
+            request.finish({"ok": False, "error": "bad request: %s" % err})
+
+    def erase(self, block):
+        """Erase a block."""
+        if not 0 <= block < self.nand.blocks:
+            return {"ok": False, "error": "invalid block %d" % block}
+
+        block_pages = self.nand.block_pages
+        self.cache.discard(block * block_pages, block_pages)
+        status_rx = self.nand_io.erase_block(block)
+        if status_rx is None:
+            return {"ok": False, "error": "transfer error"}
+        if (
+            not status_rx.status & NAND_STATUS_RDY
+            or status_rx.status & NAND_STATUS_FAIL
+        ):
+            self.log.error("Error erasing block %d!\n", block)
+            return {"ok": False, "error": "erase failed", "status": status_rx.status}
+
+        return {"ok": True, "status": status_rx.status}
+
+    def program(self, page, data):
+        """Program a raw page, padded with 0xFF."""
+        raw_page_size = self.nand.raw_page_size
+        if not 0 <= page < self.nand.pages:
+            return {"ok": False, "error": "invalid page %d" % page}
+        if len(data) > raw_page_size:
+            return {"ok": False, "error": "page data exceeds %d bytes" % raw_page_size}
+
+        self.cache.discard(page)
+        data += b"\xff" * (raw_page_size - len(data))
+        status_rx = self.nand_io.write_page(page, data)
+        if status_rx is None:
+            return {"ok": False, "error": "transfer error"}
+        if not self.nand_io.write_status_ok(page, status_rx.status, False):
+            return {"ok": False, "error": "program failed", "status": status_rx.status}
+
+        return {"ok": True, "status": status_rx.status}
+
+    def read_range(self, request):
+        """Pages of a read request, None if invalid."""
+        try:
+            start = int(request.args["page"])
+            count = int(request.args.get("count", 1))
+        except (KeyError, TypeError, ValueError) as err:
+            request.finish({"ok": False, "error": "bad request: %s" % err})
+            return None
+        if count < 1 or count > SERVE_READ_MAX_PAGES:
+            request.finish(
+                {"ok": False, "error": "count must be 1-%d" % SERVE_READ_MAX_PAGES}
+            )
+            return None
+        if start < 0 or start + count > self.nand.pages:
+            request.finish({"ok": False, "error": "invalid pages"})
+            return None
+        return range(start, start + count)
+
+    def run_reads(self, reads):
+        """Run merged read requests."""
+        ranges = []
+        wanted = set()
+        for request in reads:
+            pages = self.read_range(request)
+            if pages is not None:
+                ranges.append((request, pages))
+                wanted.update(pages)
+        if not ranges:
+            return
+
+        fetched = {}
+        for page in sorted(wanted):
+            data = self.cache.get(page)
+            if data is not None:
+                fetched[page] = data
+
+        missing = sorted(wanted.difference(fetched))
+        error = None
+        try:
+            for start, count in page_runs(missing):
+                self.stats["runs"] += 1
+                for page, data, oob in self.nand_io.iter_pages(start, count):
+                    fetched[page] = bytes(data) + bytes(oob)
+                    self.cache.put(page, fetched[page])
+                    self.stats["pages_read"] += 1
+        except Exception as err:  # pylint: disable=broad-except
+            self.log.error("Error reading pages: %s\n", err)
+            error = str(err)
+
+        for request, pages in ranges:
+            if error is not None and not all(page in fetched for page in pages):
+                request.finish({"ok": False, "error": error})
+            else:
+                request.finish({"ok": True}, b"".join(fetched[page] for page in pages))
+
+
+def remove_stale_socket(path):
+    """Remove the socket of a server that is gone, refusing anything else."""
+    try:
+        mode = os.stat(path).st_mode
+    except FileNotFoundError:
+        return
+    if not stat.S_ISSOCK(mode):
+        raise FileExistsError("%s exists and is not a socket" % path)
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        sock.connect(path)
+    except ConnectionRefusedError:
+        os.remove(path)
+        return
+    finally:
+        sock.close()
+    raise FileExistsError("%s is in use by a running server" % path)
+
+
+def page_runs(pages):
+    """Sorted pages as [start, count] runs of contiguous pages."""
+    runs = []
+    for page in pages:
+        if runs and runs[-1][0] + runs[-1][1] == page:
+            runs[-1][1] += 1
+        else:
+            runs.append([page, 1])
+    return runs
+
+
+class ServeClient:
+    """Client of a NAND server."""
+
+    def __init__(self, path):
+        """Connect to a NAND server."""
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.file = self.sock.makefile("rwb")
+
+    def close(self):
+        """Disconnect."""
+        self.file.close()
+        self.sock.close()
+
+    def request(self, args, data=None):
+        """Send a request, returns the reply and its data."""
+        if data is not None:
+            args["length"] = len(data)
+        self.file.write(json.dumps(args).encode() + b"\n")
+        if data is not None:
+            self.file.write(data)
+        self.file.flush()
+
+        line = self.file.readline()
+        if not line:
+            raise IOError("NAND server disconnected")
+        reply = json.loads(line)
+        reply_data = b""
+        if reply.get("length"):
+            reply_data = self.file.read(reply["length"])
+        if not reply["ok"]:
+            raise IOError(reply["error"])
+        return reply, reply_data
+
+    def erase(self, block):
+        """Erase a block."""
+        return self.request({"op": SERVE_OP_ERASE, "block": block})[0]
+
+    def info(self):
+        """NAND geometry."""
+        return self.request({"op": SERVE_OP_INFO})[0]
+
+    def program(self, page, data):
+        """Program a raw page."""
+        return self.request({"op": SERVE_OP_PROGRAM, "page": page}, data)[0]
+
+    def read(self, page, count=1):
+        """Read raw pages."""
+        return self.request({"op": SERVE_OP_READ, "page": page, "count": count})[1]
+
+    def stats(self):
+        """Server and cache counters."""
+        return self.request({"op": SERVE_OP_STATS})[0]
@@ -0,0 +1,293 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO content-addressed page store."""
+
+import hashlib
+import json
+import os
+import struct
+import time
+
+from .const import (
+    STORE_DIGEST_SIZE,
+    STORE_INDEX_SUFFIX,
+    STORE_MANIFEST_VERSION,
+    STORE_PACK_SUFFIX,
+    STORE_PACKS_DIR,
+)
+
+MB = 1024 * 1024
+
+STORE_INDEX_STRUCT = struct.Struct("<%dsQI" % STORE_DIGEST_SIZE)
+STORE_MISSING = bytes(STORE_DIGEST_SIZE)
+
+
+def page_digest(data):
+    """Content address of a raw page."""
+    return hashlib.blake2b(data, digest_size=STORE_DIGEST_SIZE).digest()
+
+
+class PageStore:
+    """Content-addressed page store.
+
+    Every distinct raw page (data and OOB) is kept once. The pages first
+    stored by a dump are appended to a pack of its own, and an index of the
+    digests, offsets and sizes in the pack is written once the pack is
+    complete. Only indexed packs are used, and packs are never modified, so
+    several dumps can share one store.
+    """
+
+    def __init__(self, path):
+        """Open page store."""
+        self.path = os.path.join(path, STORE_PACKS_DIR)
+        self.objects = {}
+        self.packs = {}
+        self.pack = None
+        self.pack_name = None
+        self.pack_index = []
+        self.pack_offset = 0
+        self.load()
+
+    def close(self):
+        """Index the new pack and close every pack."""
+        for pack in self.packs.values():
+            pack.close()
+        self.packs = {}
+        if self.pack is None:
+            return
+
+        self.pack.close()
+        self.pack = None
+        pack_file = os.path.join(self.path, self.pack_name)
+        if not self.pack_index:
+            os.remove(pack_file + STORE_PACK_SUFFIX)
+            return
+        tmp_file = pack_file + STORE_INDEX_SUFFIX + ".tmp"
+        with open(tmp_file, "wb") as index:
+            for entry in sorted(self.pack_index):
+                index.write(STORE_INDEX_STRUCT.pack(*entry))
+        os.replace(tmp_file, pack_file + STORE_INDEX_SUFFIX)
+
+    def get(self, digest):
+        """Raw page of a digest."""
+        name, offset, size = self.objects[digest]
+        pack = self.packs.get(name)
+        if pack is None:
+            pack_file = os.path.join(self.path, name + STORE_PACK_SUFFIX)
+            pack = self.packs[name] = open(pack_file, "rb")
+        pack.seek(offset)
+        return pack.read(size)
+
+    def load(self):
+        """Load the index of every pack."""
+        if not os.path.isdir(self.path):
+            return
+        for file in sorted(os.listdir(self.path)):
+            name, suffix = os.path.splitext(file)
+            if suffix != STORE_INDEX_SUFFIX:
+                continue
+            with open(os.path.join(self.path, file), "rb") as index:
+                for digest, offset, size in STORE_INDEX_STRUCT.iter_unpack(
+                    index.read()
+                ):
+                    self.objects.setdefault(digest, (name, offset, size))
+
+    def put(self, digest, data):
+        """Add a raw page, returns True if it wasn't stored yet."""
+        if digest in self.objects:
+            return False
+
+        if self.pack is None:
+            os.makedirs(self.path, exist_ok=True)
+            self.pack_name = "%d-%d" % (time.time_ns(), os.getpid())
+            pack_file = os.path.join(self.path, self.pack_name + STORE_PACK_SUFFIX)
+            self.pack = open(pack_file, "wb")
+        self.pack.write(data)
+        self.objects[digest] = (self.pack_name, self.pack_offset, len(data))
+        self.pack_index.append((digest, self.pack_offset, len(data)))
+        self.pack_offset += len(data)
+        return True
+
+
+class StoreManifest:
+    """Dump manifest.
+
+    A JSON header with the chip ID, geometry and whether the read completed,
+    followed by the digest of every raw page, all zero for pages that
+    weren't read. Comparing manifests finds the pages that differ without
+    touching the objects.
+    """
+
+    def __init__(self, file):
+        """Init dump manifest."""
+        self.file = file
+        self.header = {}
+        self.digests = bytearray()
+
+    @classmethod
+    def create(cls, file, nand):
+        """Empty manifest for a NAND."""
+        manifest = cls(file)
+        manifest.header = {
+            "version": STORE_MANIFEST_VERSION,
+            "mf_id": nand.mf_id,
+            "dev_id": nand.dev_id,
+            "page_size": nand.page_size,
+            "oob_size": nand.oob_size,
+            "block_pages": nand.block_pages,
+            "pages": nand.pages,
+            "complete": False,
+        }
+        manifest.digests = bytearray(nand.pages * STORE_DIGEST_SIZE)
+        return manifest
+
+    @property
+    def block_pages(self):
+        """Pages per block."""
+        return self.header["block_pages"]
+
+    @property
+    def complete(self):
+        """Check if the read of every page completed."""
+        return self.header.get("complete") is True
+
+    @property
+    def pages(self):
+        """Number of pages."""
+        return self.header["pages"]
+
+    @property
+    def raw_page_size(self):
+        """Raw page size."""
+        return self.header["page_size"] + self.header["oob_size"]
+
+    def digest(self, page):
+        """Digest of a page."""
+        offset = page * STORE_DIGEST_SIZE
+        return bytes(self.digests[offset : offset + STORE_DIGEST_SIZE])
+
+    def diff(self, other):
+        """Pages whose digest differs from another manifest."""
+        block_size = self.block_pages * STORE_DIGEST_SIZE
+        pages = []
+        # Whole blocks are compared first, most of them match
+        for offset in range(0, len(self.digests), block_size):
+            end = offset + block_size
+            if self.digests[offset:end] == other.digests[offset:end]:
+                continue
+            first = offset // STORE_DIGEST_SIZE
+            last = min(first + self.block_pages, self.pages)
+            pages += [
+                page
+                for page in range(first, last)
+                if self.digest(page) != other.digest(page)
+            ]
+        return pages
+
+    def distinct(self):
+        """Digests of the distinct pages read."""
+        digests = set(
+            bytes(self.digests[offset : offset + STORE_DIGEST_SIZE])
+            for offset in range(0, len(self.digests), STORE_DIGEST_SIZE)
+        )
+        digests.discard(STORE_MISSING)
+        return digests
+
+    def load(self):
+        """Load manifest."""
+        with open(self.file, "rb") as manifest:
+            try:
+                header = json.loads(manifest.readline())
+            except ValueError as err:
+                raise ValueError("%s: not a dump manifest" % self.file) from err
+            digests = manifest.read()
+
+        if (
+            not isinstance(header, dict)
+            or header.get("version") != STORE_MANIFEST_VERSION
+        ):
+            raise ValueError("%s: unsupported dump manifest" % self.file)
+        self.header = header
+        if len(digests) != self.pages * STORE_DIGEST_SIZE:
+            raise ValueError("%s: truncated dump manifest" % self.file)
+        self.digests = bytearray(digests)
+        return self
+
+    def same_chip(self, other):
+        """Check if another manifest has the same chip and geometry."""
+        ignored = ("complete", "version")
+        return {k: v for k, v in self.header.items() if k not in ignored} == {
+            k: v for k, v in other.header.items() if k not in ignored
+        }
+
+    def set(self, page, digest):
+        """Set the digest of a page."""
+        offset = page * STORE_DIGEST_SIZE
+        self.digests[offset : offset + STORE_DIGEST_SIZE] = digest
+
+    def sync(self):
+        """Write manifest to disk."""
+        tmp_file = self.file + ".tmp"
+        with open(tmp_file, "wb") as manifest:
+            manifest.write(json.dumps(self.header, sort_keys=True).encode() + b"\n")
+            manifest.write(self.digests)
+        os.replace(tmp_file, self.file)
+
+
+class StoreWriter:
+    """Dump into a page store, the dump file being its manifest."""
+
+    def __init__(self, file, nand, path):
+        """Open page store dump."""
+        self.store = PageStore(path)
+        self.manifest = StoreManifest.create(file, nand)
+        self.raw_page_size = nand.raw_page_size
+        self.pages = 0
+        self.new = 0
+
+    def store_page(self, page, data):
+        """Store a raw page, a page read again replaces the previous copy."""
+        digest = page_digest(bytes(data))
+        if self.store.put(digest, data):
+            self.new += 1
+        self.manifest.set(page, digest)
+        self.pages += 1
+
+    def close(self, res=True):
+        """Index the stored pages and write the manifest."""
+        self.store.close()
+        self.manifest.header["complete"] = bool(res)
+        self.manifest.sync()
+
+    def log_summary(self, log):
+        """Log deduplication."""
+        log.info(
+            "Page store: %d pages, %d distinct, %d new (%.2f MB added)\n",
+            self.pages,
+            len(self.manifest.distinct()),
+            self.new,
+            self.new * self.raw_page_size / MB,
+        )
+
+
+def store_to_raw(file, path, raw_file):
+    """Rebuild a raw dump from the manifest of a complete read.
+
+    Pages without a digest are left 0xFF and returned, so they can be
+    reported.
+    """
+    manifest = StoreManifest(file).load()
+    if not manifest.complete:
+        raise ValueError("%s: manifest of an incomplete read" % file)
+    store = PageStore(path)
+    blank = b"\xff" * manifest.raw_page_size
+    missing = []
+    with open(raw_file, "wb") as out:
+        for page in range(manifest.pages):
+            digest = manifest.digest(page)
+            if digest == STORE_MISSING:
+                missing.append(page)
+                out.write(blank)
+            else:
+                out.write(store.get(digest))
+    store.close()
+    return missing
@@ -0,0 +1,80 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO page streaming."""
+
+import queue
+import threading
+
+from .metrics import ReadMetrics
+from .pipeline import ReadPipeline
+
+
+class PageStream:
+    """Pages read straight to the caller.
+
+    Acts as the output of a read pipeline run in the background, so pages
+    get the same verification and retries as a dump. Every page is handed
+    out as memoryviews into the pipeline buffers, which are only recycled
+    once the caller takes the next page. Pages come in read order, except
+    retried ones which come later. Closing the iterator early stops the
+    pipeline and drops the responses in flight.
+    """
+
+    def __init__(self, nand_io, pages, *, votes=1):
+        """Init page stream."""
+        self.nand_io = nand_io
+        self.page_size = nand_io.nand.page_size
+        self.ecc = None
+        self.items = queue.Queue(1)
+        self.released = threading.Semaphore(0)
+        self.closed = threading.Event()
+        self.ended = False
+        self.res = False
+
+        metrics = ReadMetrics(nand_io.log, progress=False)
+        metrics.begin(len(pages), nand_io.nand.raw_page_size)
+        self.pipeline = ReadPipeline(
+            nand_io, self, votes=votes, pages=pages, metrics=metrics, report=False
+        )
+
+    def __iter__(self):
+        """Iterate over (page, data, oob)."""
+        thread = threading.Thread(target=self.run, daemon=True)
+        thread.start()
+        try:
+            while True:
+                item = self.items.get()
+                if item is None:
+                    self.ended = True
+                    break
+                page, view = item
+                yield page, view[: self.page_size], view[self.page_size :]
+                self.released.release()
+        finally:
+            if not self.ended:
+                self.stop()
+            thread.join()
+
+        if not self.res:
+            raise IOError("NAND read failed")
+
+    def run(self):
+        """Run the read pipeline."""
+        self.res = self.pipeline.run()
+        if self.closed.is_set():
+            self.nand_io.pkt_barrier()
+        self.items.put(None)
+
+    def stop(self):
+        """Stop reading before the last page."""
+        self.closed.set()
+        self.pipeline.fail(None)
+        self.released.release()
+        while self.items.get() is not None:
+            pass
+
+    def store_page(self, page, data, _flags=0, _flips=None):
+        """Hand a page to the caller and wait until it is done with it."""
+        if self.closed.is_set():
+            return
+        self.items.put((page, data))
+        self.released.acquire()
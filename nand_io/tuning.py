@@ -0,0 +1,196 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO read timing calibration."""
+
+import json
+import os
+
+from serial.tools import list_ports
+
+from .const import (
+    NM_RE_DELAY_NOPS,
+    NM_READ_DELAY_US,
+    SERIAL_DEVICES,
+    TUNE_CACHE_DIR,
+    TUNE_CACHE_FILE,
+    TUNE_PASSES,
+    TUNE_RE_DELAY_NOPS,
+    TUNE_READ_DELAYS_US,
+    TUNE_SAMPLE_PAGES,
+)
+
+
+def programmer_id(device, serial_device):
+    """Identify a programmer by its type and USB serial number or port."""
+    name = SERIAL_DEVICES.get(device, str(device))
+    if not isinstance(serial_device, str):
+        return "%s:%s" % (name, type(serial_device).__name__)
+
+    path = os.path.realpath(serial_device)
+    for port in list_ports.comports():
+        if port.serial_number and os.path.realpath(port.device) == path:
+            return "%s:%s" % (name, port.serial_number)
+
+    return "%s:%s" % (name, serial_device)
+
+
+class TimingCache:
+    """Tuned read timings per NAND chip and programmer."""
+
+    def __init__(self, path=None):
+        """Init timing cache."""
+        if path is None:
+            cache_dir = os.environ.get("XDG_CACHE_HOME") or os.path.join(
+                os.path.expanduser("~"), ".cache"
+            )
+            path = os.path.join(cache_dir, TUNE_CACHE_DIR, TUNE_CACHE_FILE)
+        self.path = path
+
+    @staticmethod
+    def key(nand, programmer):
+        """Cache key of a NAND chip on a programmer."""
+        return "%02x%02x@%s" % (nand.mf_id, nand.dev_id, programmer)
+
+    def load(self):
+        """Load all cached timings."""
+        try:
+            with open(self.path, "r", encoding="utf-8") as cache:
+                return json.load(cache)
+        except (OSError, ValueError):
+            return {}
+
+    def apply(self, nand, programmer):
+        """Apply cached timings to a NAND, returns True if found."""
+        timing = self.load().get(self.key(nand, programmer))
+        if not timing:
+            return False
+
+        nand.read_delay_us = timing[NM_READ_DELAY_US]
+        nand.re_delay_nops = timing[NM_RE_DELAY_NOPS]
+
+        return True
+
+    def store(self, nand, programmer):
+        """Store the current timings of a NAND."""
+        timings = self.load()
+        timings[self.key(nand, programmer)] = {
+            NM_READ_DELAY_US: nand.read_delay_us,
+            NM_RE_DELAY_NOPS: nand.re_delay_nops,
+        }
+
+        os.makedirs(os.path.dirname(self.path), exist_ok=True)
+        tmp_path = self.path + ".tmp"
+        with open(tmp_path, "w", encoding="utf-8") as cache:
+            json.dump(timings, cache, indent=1, sort_keys=True)
+        os.replace(tmp_path, self.path)
+
+
+class ReadTuner:
+    """Read timing calibration.
+
+    Sample pages spread over the chip are read with the slowest settings as
+    a reference, then the read delay and RE# low time are tightened one step
+    at a time, starting from the device table timings, until a read differs
+    from the reference. The fastest setting without mismatches, backed off
+    by one step of margin, is kept. It is never slower than the table.
+    """
+
+    def __init__(self, nand_io, cache):
+        """Init read tuner."""
+        self.nand_io = nand_io
+        self.log = nand_io.log
+        self.nand = nand_io.nand
+        self.cache = cache
+
+    def sample_pages(self):
+        """Pages read at every setting."""
+        step = max(self.nand.pages // TUNE_SAMPLE_PAGES, 1)
+        return list(range(0, self.nand.pages, step))[:TUNE_SAMPLE_PAGES]
+
+    def read_sample(self, pages):
+        """Read the sample pages with the current settings."""
+        return [self.nand_io.read_page(page) for page in pages]
+
+    def matches(self, pages, reference):
+        """Check sample reads against the reference."""
+        for _ in range(TUNE_PASSES):
+            if self.read_sample(pages) != reference:
+                return False
+        return True
+
+    @staticmethod
+    def candidates(table, settings):
+        """Table setting followed by the faster tuning settings."""
+        return [table] + [setting for setting in settings if setting < table]
+
+    def sweep(self, name, settings, config, pages, reference):
+        """Find the fastest matching setting, returns it with a margin.
+
+        Returns None if even the first setting, the table one, mismatches.
+        """
+        fastest = None
+        for index, setting in enumerate(settings):
+            config(setting)
+            ok = self.matches(pages, reference)
+            self.log.info("\t%s %d: %s\n", name, setting, "ok" if ok else "mismatch")
+            if not ok:
+                break
+            fastest = index
+
+        if fastest is None:
+            return None
+        return settings[max(fastest - 1, 0)]
+
+    def run(self, programmer):
+        """Tune read timings and cache them."""
+        nand_io = self.nand_io
+        pages = self.sample_pages()
+        table_delay_us = self.nand.table_read_delay_us
+        table_nops = self.nand.table_re_delay_nops
+        # A zero read delay waits for ready/busy, there is nothing to tune
+        if table_delay_us:
+            slow_delay_us = max(TUNE_READ_DELAYS_US[0], table_delay_us)
+        else:
+            slow_delay_us = 0
+        slow_nops = max(TUNE_RE_DELAY_NOPS[0], table_nops)
+
+        self.log.info("Tuning read timing (%d sample pages)\n", len(pages))
+        nand_io.read_config(slow_delay_us, slow_nops)
+        reference = self.read_sample(pages)
+        if None in reference or self.read_sample(pages) != reference:
+            self.log.error("Reference read is not stable!\n")
+            return False
+
+        delay_us = self.sweep(
+            "Read delay (us)",
+            self.candidates(table_delay_us, TUNE_READ_DELAYS_US),
+            lambda delay_us: nand_io.read_config(delay_us, slow_nops),
+            pages,
+            reference,
+        )
+        nops = None
+        if delay_us is not None:
+            nops = self.sweep(
+                "RE# delay (nops)",
+                self.candidates(table_nops, TUNE_RE_DELAY_NOPS),
+                lambda nops: nand_io.read_config(delay_us, nops),
+                pages,
+                reference,
+            )
+        if nops is None:
+            # Nothing faster than the table to cache, reads need slowing down
+            nand_io.read_config(table_delay_us, table_nops)
+            self.log.error("Reads with the table timing mismatch, not cached!\n")
+            return False
+        nand_io.read_config(delay_us, nops)
+
+        self.log.info(
+            "Tuned read timing: read delay %d us, RE# delay %d nops\n",
+            delay_us,
+            nops,
+        )
+        try:
+            self.cache.store(self.nand, programmer)
+        except OSError as err:
+            self.log.error("Error caching read timing: %s\n", err)
+
+        return True
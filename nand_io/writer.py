@@ -0,0 +1,233 @@
+# SPDX-License-Identifier: MIT
+"""NAND IO page writing."""
+
+import os
+
+from .const import PAGE_RW_RETRIES
+from .image import blank_blocks, open_image, write_plan
+from .protocol import NAND_STATUS_ERASE_FAIL
+from .stream import PageStream
+
+
+class PageWriter:
+    """Raw dump writer.
+
+    Every block is erased without waiting, so tBERS runs while its first
+    page is sent to the device, and an erase failure is reported by the
+    next response. Blank pages aren't programmed and blocks blank in an
+    optional base dump of the current contents aren't erased, once they
+    read back blank. Pages of a block are cache programmed when the NAND
+    supports it, closing the cache program before the next erase. A page
+    whose response is lost is read back before it is sent again.
+    """
+
+    def __init__(self, nand_io):
+        """Init page writer."""
+        self.nand_io = nand_io
+        self.log = nand_io.log
+        self.nand = nand_io.nand
+        # Block of the no-wait erase whose result is still unknown
+        self.erase_block = None
+        # Last cache programmed page, reported by FAILC
+        self.prev_page = None
+        self.retries = PAGE_RW_RETRIES
+        self.written = 0
+        self.total = 0
+
+    def plan(self, file, base):
+        """Blocks to erase and the pages to program in each of them."""
+        raw_page_size = self.nand.raw_page_size
+        block_pages = self.nand.block_pages
+        pages = (os.path.getsize(file) + raw_page_size - 1) // raw_page_size
+        if pages > self.nand.pages:
+            self.log.warning("File exceeds NAND size, ignoring trailing data.\n")
+            pages = self.nand.pages
+        blocks = (pages + block_pages - 1) // block_pages
+
+        # Blocks known to be blank don't need an erase
+        blank = set()
+        if base:
+            blank = self.base_blank(
+                blank_blocks(base, self.nand.raw_block_size, blocks)
+            )
+        plan = write_plan(file, raw_page_size, block_pages, pages, blank)
+
+        erases = sum(1 for _, erase, _ in plan if erase)
+        self.total = sum(len(data_pages) for _, _, data_pages in plan)
+        self.log.info(
+            "Write plan: %d erases, %d pages (%d blank pages skipped)\n",
+            erases,
+            self.total,
+            pages - self.total,
+        )
+        return plan
+
+    def base_blank(self, blank):
+        """Blocks blank in the base dump that still read back blank.
+
+        A stale base dump would skip erases of blocks holding data, so every
+        page of those blocks is read from the NAND, since blank pages may
+        come before programmed ones. Blocks that aren't blank anymore, or
+        can't be read, are erased as usual.
+        """
+        block_pages = self.nand.block_pages
+        blank_data = b"\xff" * self.nand.page_size
+        blank_oob = b"\xff" * self.nand.oob_size
+        pages = [
+            block * block_pages + index
+            for block in sorted(blank)
+            for index in range(block_pages)
+        ]
+        blank_pages = dict.fromkeys(blank, 0)
+        try:
+            for page, data, oob in PageStream(self.nand_io, pages):
+                if data == blank_data and oob == blank_oob:
+                    blank_pages[page // block_pages] += 1
+        except IOError as err:
+            self.log.error("Error reading the blank blocks: %s\n", err)
+
+        stale = {block for block, count in blank_pages.items() if count < block_pages}
+        if stale:
+            self.log.warning(
+                "Base dump is out of date, %d blocks blank in it aren't blank"
+                " on the NAND and will be erased\n",
+                len(stale),
+            )
+        return blank - stale
+
+    def run(self, file, base=None):
+        """Write a raw dump."""
+        plan = self.plan(file, base)
+
+        res = True
+        inp = open_image(file)
+        for index, (block, erase, data_pages) in enumerate(plan):
+            # The erase runs while the first page is sent to the device
+            if erase and not self.erase(block):
+                res = False
+                break
+
+            # Cache program has to be closed before the next erase
+            next_cache = False
+            if index + 1 < len(plan):
+                next_cache = not plan[index + 1][1] and bool(plan[index + 1][2])
+
+            if not self.write_block(inp, data_pages, next_cache):
+                res = False
+                break
+        inp.close()
+
+        return res and self.finish()
+
+    def erase(self, block):
+        """Start a no-wait block erase."""
+        status_rx = self.nand_io.erase_block(block, wait=False)
+        # A failure flag refers to the previous no-wait erase
+        if status_rx is None or status_rx.flags & NAND_STATUS_ERASE_FAIL:
+            if status_rx is None:
+                self.erase_block = block
+            self.log.error("\nError erasing block %d!\n", self.erase_block)
+            return False
+        self.erase_block = block
+        return True
+
+    def write_block(self, inp, data_pages, next_cache):
+        """Program the pages of a block."""
+        raw_page_size = self.nand.raw_page_size
+        offset = 0
+        while offset < len(data_pages):
+            page = data_pages[offset]
+            inp.seek(page * raw_page_size)
+            page_bytes = inp.read(raw_page_size)
+            page_bytes += b"\xff" * (raw_page_size - len(page_bytes))
+
+            # Cache program lets the next page stream in during tPROG
+            cache = self.nand.cache_program and (
+                offset + 1 < len(data_pages) or next_cache
+            )
+            res = self.program(page, page_bytes, cache)
+            if res is None:
+                return False
+            if not res:
+                continue
+            offset += 1
+            self.written += 1
+
+            write_percent = int(round(self.written * 100 / self.total, 0))
+            self.log.info(
+                "Writing NAND %d%% (page=%d/%d)\r",
+                write_percent,
+                self.written,
+                self.total,
+            )
+        return True
+
+    def program(self, page, page_bytes, cache):
+        """Program a page.
+
+        Returns True once it is programmed, False if it has to be sent again
+        and None on failure.
+        """
+        status_rx = self.nand_io.write_page(page, page_bytes, cache)
+        if status_rx is None:
+            # The page may be programmed with only the response lost
+            programmed = self.lost(
+                page, page_bytes, cache or self.prev_page is not None
+            )
+            if not programmed:
+                self.retries -= 1
+                self.log.error(
+                    "\nError writing page %d! (%d retries left)\n",
+                    page,
+                    self.retries,
+                )
+                if programmed is None or self.retries == 0:
+                    return None
+                return False
+        elif status_rx.flags & NAND_STATUS_ERASE_FAIL:
+            self.log.error("\nError erasing block %d!\n", self.erase_block)
+            return None
+        elif not self.nand_io.write_status_ok(
+            page, status_rx.status, cache, self.prev_page
+        ):
+            return None
+        self.retries = PAGE_RW_RETRIES
+        self.erase_block = None
+        self.prev_page = page if cache else None
+        return True
+
+    def lost(self, page, page_bytes, cache):
+        """Find out if a page whose write response was lost got programmed.
+
+        Returns True if it reads back programmed, False if it is still blank
+        and None if that can't be told. Reading back would break an open
+        cache program, so pages of one are never checked.
+        """
+        status_rx = self.nand_io.status()
+        if status_rx is None:
+            return None
+        if status_rx.flags & NAND_STATUS_ERASE_FAIL:
+            self.log.error("\nError erasing block %d!\n", page // self.nand.block_pages)
+            return None
+        if cache:
+            self.log.error("\nCan't check page %d in a cache program!\n", page)
+            return None
+
+        page_rx = self.nand_io.read_page(page)
+        if page_rx in (page_bytes, b"\xff" * len(page_bytes)):
+            return page_rx == page_bytes
+        if page_rx is not None:
+            self.log.error("\nPage %d is partly programmed!\n", page)
+        return None
+
+    def finish(self):
+        """Collect the result of a trailing erase."""
+        if self.erase_block is not None:
+            status_rx = self.nand_io.status()
+            if status_rx is None or status_rx.flags & NAND_STATUS_ERASE_FAIL:
+                self.log.error("\nError erasing block %d!\n", self.erase_block)
+                return False
+
+        self.log.info("\n")
+
+        return True